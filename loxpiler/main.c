@@ -6,9 +6,12 @@
 #include "./src/common.h"
 #include "src/chunk.h"
 #include "src/debug.h"
+#include "src/memory.h"
 #include "src/vm.h"
 #include <string.h>
 
+#define USAGE "Usage: clox [--gc-min-heap=SIZE] [--gc-growth=RATIO] [--gc-heap-limit=SIZE] [--gc-pause-us=N] [--gc-threads=N] [path]\n"
+
 static void repl(void) {
 	char line[1024];
 
@@ -70,18 +73,137 @@ static void run_file(const char* path) {
 		exit(70);
 }
 
+//Bytes with an optional K, M or G suffix
+static bool parse_size(const char* text, size_t* size) {
+	char* end;
+	double value = strtod(text, &end);
+	switch (*end) {
+		case 'k': case 'K': value *= 1024; end++; break;
+		case 'm': case 'M': value *= 1024 * 1024; end++; break;
+		case 'g': case 'G': value *= 1024 * 1024 * 1024; end++; break;
+	}
+	if (end == text || *end != '\0' || value < 0)
+		return false;
+	*size = (size_t)value;
+	return true;
+}
+
+static bool parse_int(const char* text, int* number) {
+	char* end;
+	long value = strtol(text, &end, 10);
+	if (end == text || *end != '\0' || value < 0 || value > INT32_MAX)
+		return false;
+	*number = (int)value;
+	return true;
+}
+
+static bool set_min_heap(GcOptions* options, const char* value) {
+	return parse_size(value, &options->minHeap);
+}
+
+static bool set_growth(GcOptions* options, const char* value) {
+	char* end;
+	options->heapGrowth = strtod(value, &end);
+	//Growing by less than what survived would collect on every allocation
+	return end != value && *end == '\0' && options->heapGrowth > 1;
+}
+
+static bool set_heap_limit(GcOptions* options, const char* value) {
+	return parse_size(value, &options->heapLimit);
+}
+
+static bool set_pause(GcOptions* options, const char* value) {
+	return parse_int(value, &options->pauseBudget) && options->pauseBudget > 0;
+}
+
+static bool set_threads(GcOptions* options, const char* value) {
+	return parse_int(value, &options->markThreads);
+}
+
+//Collector setting, --gc-<name>=<value> on the command line or the environment variable
+typedef struct {
+	const char* name;
+	const char* variable;
+	bool (*set)(GcOptions* options, const char* value);
+} GcOption;
+
+static const GcOption gcOptionTable[] = {
+	{ "min-heap",   "LOX_GC_MIN_HEAP",   set_min_heap },
+	{ "growth",     "LOX_GC_GROWTH",     set_growth },
+	{ "heap-limit", "LOX_GC_HEAP_LIMIT", set_heap_limit },
+	{ "pause-us",   "LOX_GC_PAUSE_US",   set_pause },
+	{ "threads",    "LOX_GC_THREADS",    set_threads },
+};
+
+#define GC_OPTION_COUNT (int)(sizeof(gcOptionTable) / sizeof(gcOptionTable[0]))
+
+//Option the flag is for, NULL if there is none by that name
+static const GcOption* find_gc_option(const char* name, size_t length) {
+	for (int i = 0; i < GC_OPTION_COUNT; i++) {
+		if (strlen(gcOptionTable[i].name) == length && strncmp(gcOptionTable[i].name, name, length) == 0)
+			return &gcOptionTable[i];
+	}
+	return NULL;
+}
+
+static void invalid_gc_option(const char* name, const char* value) {
+	fprintf(stderr, "Invalid value '%s' for %s.\n", value, name);
+	fprintf(stderr, USAGE);
+	exit(64);
+}
+
+//Environment variables first, flags override them
+static void read_gc_options(GcOptions* options, int argc, const char* argv[]) {
+	default_gc_options(options);
+
+	for (int i = 0; i < GC_OPTION_COUNT; i++) {
+		char value[64];
+		size_t length;
+		if (getenv_s(&length, value, sizeof(value), gcOptionTable[i].variable) == 0 && length > 0
+				&& !gcOptionTable[i].set(options, value))
+			invalid_gc_option(gcOptionTable[i].variable, value);
+	}
+
+	for (int arg = 1; arg < argc; arg++) {
+		if (strncmp(argv[arg], "--gc-", 5) != 0)
+			continue;
+
+		const char* name = argv[arg] + 5;
+		const char* value = strchr(name, '=');
+		const GcOption* option = value == NULL ? NULL : find_gc_option(name, value - name);
+		if (option == NULL) {
+			fprintf(stderr, "Unknown option '%s'.\n", argv[arg]);
+			fprintf(stderr, USAGE);
+			exit(64);
+		}
+		if (!option->set(options, value + 1))
+			invalid_gc_option(argv[arg], value + 1);
+	}
+}
+
 int main(int argc, const char* argv[]) {
-	init_vm();
-	
-	if(argc == 1) {
-		repl();
-	} else if (argc == 2) {
-		run_file(argv[1]);
-	} else {
-		fprintf(stderr, "Usage: clox [path]\n");
-		exit(64);
+	GcOptions options;
+	read_gc_options(&options, argc, argv);
+
+	//Whatever is not a collector option is the script to run
+	const char* path = NULL;
+	for (int arg = 1; arg < argc; arg++) {
+		if (strncmp(argv[arg], "--gc-", 5) == 0)
+			continue;
+		if (path != NULL) {
+			fprintf(stderr, USAGE);
+			exit(64);
+		}
+		path = argv[arg];
 	}
 
+	init_vm(&options);
+
+	if (path == NULL)
+		repl();
+	else
+		run_file(path);
+
 	free_vm();
 	return 0;
 }
@@ -6,8 +6,10 @@
 void init_chunk(Chunk* chunk) {
 	chunk->size = 0;
 	chunk->capacity = 0;
-	chunk->lines = NULL;
 	chunk->code = NULL;
+	chunk->lineCount = 0;
+	chunk->lineCapacity = 0;
+	chunk->lines = NULL;
 	init_value_array(&chunk->constants);
 }
 
@@ -16,12 +18,24 @@ void write_chunk(Chunk* chunk, uint8_t byte, int line) {
 		const int oldCap = chunk->capacity;
 		chunk->capacity = GROW_CAPACITY(oldCap);
 		chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCap, chunk->capacity);
-		chunk->lines = GROW_ARRAY(int, chunk->lines, oldCap, chunk->capacity);
 	}
 
 	chunk->code[chunk->size] = byte;
-	chunk->lines[chunk->size] = line;
 	chunk->size++;
+
+	//Still on the same line -> byte belongs to the current run
+	if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line)
+		return;
+
+	if (chunk->lineCount >= chunk->lineCapacity) {
+		const int oldCap = chunk->lineCapacity;
+		chunk->lineCapacity = GROW_CAPACITY(oldCap);
+		chunk->lines = GROW_ARRAY(LineStart, chunk->lines, oldCap, chunk->lineCapacity);
+	}
+
+	LineStart* lineStart = &chunk->lines[chunk->lineCount++];
+	lineStart->offset = chunk->size - 1;
+	lineStart->line = line;
 }
 
 //returns index where constant was added so we can locate it later
@@ -33,9 +47,33 @@ int add_constant(Chunk* chunk, Value value) {
 	return chunk->constants.size - 1;
 }
 
+//Only needed for errors and disassembly, so decoding the runs can be slow(er)
+int get_line(Chunk* chunk, int offset) {
+	//Binary search for the last run that starts at or before offset
+	int low = 0;
+	int high = chunk->lineCount - 1;
+	while (low < high) {
+		int mid = low + (high - low + 1) / 2;
+		if (chunk->lines[mid].offset <= offset) {
+			low = mid;
+		} else {
+			high = mid - 1;
+		}
+	}
+	return chunk->lines[low].line;
+}
+
+//Chunk is done after compiling: give back the unused capacity of the growable arrays
+void shrink_chunk(Chunk* chunk) {
+	chunk->code = GROW_ARRAY(uint8_t, chunk->code, chunk->capacity, chunk->size);
+	chunk->capacity = chunk->size;
+	chunk->lines = GROW_ARRAY(LineStart, chunk->lines, chunk->lineCapacity, chunk->lineCount);
+	chunk->lineCapacity = chunk->lineCount;
+}
+
 void free_chunk(Chunk* chunk) {
 	//Deallocate memory
-	FREE_ARRAY(int, chunk->lines, chunk->capacity);
+	FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
 	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
 	free_value_array(&chunk->constants);
 	//Reset to empty state
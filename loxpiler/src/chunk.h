@@ -16,8 +16,16 @@ typedef enum {
 	OP_SET_GLOBAL,
 	OP_GET_UPVALUE,
 	OP_SET_UPVALUE,
+	//Read a variable the closure captured by value
+	OP_GET_CAPTURED,
 	OP_GET_PROPERTY,
 	OP_SET_PROPERTY,
+	//Method lookup without binding: leaves the receiver and pushes the method closure
+	//Fields leave nil in the receiver spot and push the field's value
+	OP_GET_METHOD,
+	//Pops receiver and method from OP_GET_METHOD, pushes the bound method
+	OP_BIND_METHOD,
+	//Method name, 16 bit call cache index
 	OP_GET_SUPER,
 	OP_EQUAL,
 	OP_GREATER,
@@ -32,24 +40,53 @@ typedef enum {
 	OP_JUMP,
 	OP_JUMP_IF_FALSE,
 	OP_LOOP,
+	//argCount, 16 bit call cache index
 	OP_CALL,
+	//argCount, receiver + args on the stack with the method from OP_GET_METHOD on top
+	OP_CALL_METHOD,
 	OP_INVOKE,
+	//Method name, argCount, 16 bit call cache index
 	OP_SUPER_INVOKE,
+	//OP_CALL / OP_INVOKE in tail position (return f(x);), reuses the caller's call frame
+	OP_TAIL_CALL,
+	OP_TAIL_INVOKE,
+	//Function constant, with GC_PRETENURE a 16 bit call cache index for the allocation site, then the upvalue operand pairs
 	OP_CLOSURE,
 	OP_CLOSE_UPVALUE,
 	OP_RETURN,
+	//Name constant, with GC_PRETENURE a 16 bit call cache index for the allocation site
 	OP_CLASS,
 	OP_INHERIT,
 	OP_METHOD,
+	//Prefix: next instruction has a 24 bit operand instead of a single byte (or 2 bytes for jumps)
+	OP_WIDE,
 } OpCode;
 
+//Flags in the first byte of each OP_CLOSURE upvalue operand pair
+//Index is 1 byte or 2 bytes when UPVALUE_WIDE is set
+//UPVALUE_VALUE copies the variable into the closure instead of sharing it through an ObjUpvalue
+#define UPVALUE_LOCAL 0x1
+#define UPVALUE_WIDE  0x2
+#define UPVALUE_VALUE 0x4
+
+//Run of bytecode that was compiled from the same source line
+typedef struct {
+	//Offset of the first byte of the run
+	int offset;
+	int line;
+} LineStart;
+
 typedef struct {
 	//Array of bytes (instructions)
 	int size;
 	int capacity;
 	uint8_t* code;
-	//Store line numbers parallel with bytecode for errors
-	int* lines;
+	//Line numbers for errors, run-length encoded
+	//A new entry only gets added when the line changes, most lines compile to many bytes
+	//Sorted by offset so we can binary search it
+	int lineCount;
+	int lineCapacity;
+	LineStart* lines;
 	//Constant pool to store every constant
 	ValueArray constants;
 } Chunk;
@@ -57,4 +94,6 @@ typedef struct {
 void init_chunk(Chunk* chunk);
 void write_chunk(Chunk* chunk, uint8_t byte, int line);
 int add_constant(Chunk* chunk, Value value);
+int get_line(Chunk* chunk, int offset);
+void shrink_chunk(Chunk* chunk);
 void free_chunk(Chunk* chunk);
@@ -8,5 +8,41 @@
 //#define DEBUG_PRINT_CODE
 //#define DEBUG_TRACE_EXECUTION
 #define DEBUG_STRESS_GC
+//Allocate into a nursery and promote survivors of minor collections to the old generation
+#define GC_GENERATIONAL
+//Spread marking and sweeping over many short steps instead of one long pause
+//#define GC_INCREMENTAL
+//Mark on a background thread while the program keeps running, the VM only stops for the roots and to finish up
+//#define GC_CONCURRENT
+#ifdef GC_CONCURRENT
+#ifndef GC_GENERATIONAL
+//Compiler writes into it's functions without barriers, marking has to start at a safepoint in run()
+#error "GC_CONCURRENT needs GC_GENERATIONAL"
+#endif
+//Uses the incremental collector's barrier and phases, the thread only takes over the marking steps
+#define GC_INCREMENTAL
+#endif
+//Stop the world collections mark with several threads at once
+//#define GC_PARALLEL
+#if defined(GC_PARALLEL) && defined(GC_INCREMENTAL)
+#error "GC_PARALLEL speeds up the stop the world collector, it can't be combined with GC_INCREMENTAL"
+#endif
+//Move old objects out of mostly empty regions so they can be given back, after a collection left the heap fragmented
+//#define GC_COMPACT
+#if defined(GC_COMPACT) && !defined(GC_GENERATIONAL)
+//Objects can only move at a safepoint in run()
+#error "GC_COMPACT needs GC_GENERATIONAL"
+#endif
+//Allocation sites whose objects mostly survive their first minor collection allocate straight into the old generation
+//#define GC_PRETENURE
+#if defined(GC_PRETENURE) && !defined(GC_GENERATIONAL)
+//Without a nursery every object is old from the start already
+#error "GC_PRETENURE needs GC_GENERATIONAL"
+#endif
+//Allocate every object out of one reserved block of at most 4GB and keep references in tables and closures as 32 bit offsets into it
+//#define GC_COMPRESSED_REFS
 //#define DEBUG_LOG_GC
-#define UINT8_COUNT (UINT8_MAX + 1)
\ No newline at end of file
+#define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+//Largest operand that fits in the 3 operand bytes of a OP_WIDE instruction
+#define UINT24_MAX 0xffffff
\ No newline at end of file
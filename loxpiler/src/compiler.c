@@ -55,13 +55,28 @@ typedef struct {
 	//Scope depth of the block where the local variable was declared
 	int depth;
 	bool isCaptured;
+	//var f = obj.m; kept unbound: method in this slot and receiver in the slot below
+	//Calling f needs no ObjBoundMethod, other uses make one once and store it back in this slot
+	bool isMethod;
 } Local;
 
 typedef struct {
-	uint8_t index;
+	uint16_t index;
 	bool isLocal;
+	//Variable is never assigned, closure gets a copy of it's value
+	bool byValue;
 } Upvalue;
 
+typedef struct {
+	//Location of the operand that still needs to be backpatched
+	int offset;
+	//Stack depth when the jump is taken
+	int depth;
+	//Operand is 24 bits (OP_WIDE jump) instead of 16
+	bool wide;
+	bool patched;
+} Jump;
+
 typedef enum {
 	TYPE_FUNCTION,
 	TYPE_METHOD,
@@ -76,11 +91,31 @@ typedef struct Compiler{
 	//Compiling top-level code vs body of a function
 	FunctionType type;
 	//Array of local vars that are currently in scope during each point of compilation
-	//Instruction operand = single byte -> Max locals = uint8 max (256 indexes available)
-	Local locals[UINT8_COUNT];
+	//First 256 locals fit in a single byte operand, the rest need OP_WIDE -> Max locals = uint16 max
+	//Grows on demand so small functions don't reserve room for 65 536 locals
+	Local* locals;
 	//How many locals are in scope atm / how many array slots are in use
 	int localCount;
-	Upvalue upvalues[UINT8_COUNT];
+	int localCapacity;
+	Upvalue* upvalues;
+	int upvalueCapacity;
+	//Forward jumps that have been emitted but not patched yet
+	Jump* jumps;
+	int jumpCount;
+	int jumpCapacity;
+	//Opcode offset of the last emitted OP_CALL/OP_INVOKE and where that instruction ends
+	//If a return expression ends right there the call is in tail position
+	int lastCall;
+	int lastCallEnd;
+	//Same for the last OP_GET_PROPERTY, a variable initialized with it can skip binding the method
+	int lastProperty;
+	int lastPropertyEnd;
+	//Offset the last forward jump landed on
+	int lastJumpTarget;
+	//Stack slots in use at this point of the code (locals + temporaries)
+	int stackDepth;
+	//Number of OP_CALL and super instructions, each gets it's own call cache
+	int callSiteCount;
 	//Number of blocks surrounding the current bit of code we are compiling
 	//0 - global / 1 - 1 block nested / ...
 	int scopeDepth;
@@ -93,6 +128,30 @@ typedef struct ClassCompiler {
 
 static ParseRule* get_rule(TokenType type);
 
+//Net effect of each instruction on the stack
+//Calls also pop their args, that depends on the arg count so it gets added where the call is emitted
+static const int stackEffects[] = {
+	[OP_CONSTANT] = 1, [OP_NIL] = 1, [OP_TRUE] = 1, [OP_FALSE] = 1, [OP_POP] = -1,
+	[OP_GET_LOCAL] = 1, [OP_SET_LOCAL] = 0,
+	[OP_GET_GLOBAL] = 1, [OP_DEFINE_GLOBAL] = -1, [OP_SET_GLOBAL] = 0,
+	[OP_GET_UPVALUE] = 1, [OP_SET_UPVALUE] = 0, [OP_GET_CAPTURED] = 1,
+	[OP_GET_PROPERTY] = 0, [OP_SET_PROPERTY] = -1, [OP_GET_SUPER] = -1,
+	[OP_GET_METHOD] = 1, [OP_BIND_METHOD] = -1,
+	[OP_EQUAL] = -1, [OP_GREATER] = -1, [OP_LESS] = -1,
+	[OP_ADD] = -1, [OP_SUBTRACT] = -1, [OP_MULTIPLY] = -1, [OP_DIVIDE] = -1,
+	[OP_NOT] = 0, [OP_NEGATE] = 0, [OP_PRINT] = -1,
+	[OP_JUMP] = 0, [OP_JUMP_IF_FALSE] = 0, [OP_LOOP] = 0,
+	[OP_CALL] = 0, [OP_CALL_METHOD] = 0, [OP_INVOKE] = 0, [OP_SUPER_INVOKE] = -1,
+	[OP_TAIL_CALL] = 0, [OP_TAIL_INVOKE] = 0,
+	[OP_CLOSURE] = 1, [OP_CLOSE_UPVALUE] = -1, [OP_RETURN] = -1,
+	[OP_CLASS] = 1, [OP_INHERIT] = -1, [OP_METHOD] = -1,
+	[OP_WIDE] = 0,
+};
+
+//Open forward jumps further away than this get routed through a wide jump island
+//Leaves half of the 16 bit range as headroom for the code emitted between two checks
+#define JUMP_ISLAND_DISTANCE (UINT16_MAX / 2)
+
 //Global var to not have to pass around as ptr
 Parser parser;
 Compiler* current = NULL;
@@ -102,6 +161,10 @@ Compiler* current = NULL;
 //Implicit linked stack
 ClassCompiler* currentClass = NULL;
 
+//Names that are the target of an assignment somewhere in the source being compiled
+//Keys only, values are nil
+Table assignedNames;
+
 Chunk* compilingChunk;
 
 static Chunk* current_chunk(void) {
@@ -183,69 +246,201 @@ static void emit_bytes(uint8_t byte1, uint8_t byte2) {
 	emit_byte(byte2);
 }
 
-static void emit_loop(int loopStart) {
-	emit_byte(OP_LOOP);
+//Track how many stack slots the function needs at most
+//The VM checks that once when it enters the function instead of on every push
+static void adjust_stack(int effect) {
+	current->stackDepth += effect;
+	if (current->stackDepth > current->function->maxStack)
+		current->function->maxStack = current->stackDepth;
+}
+
+//Instruction without operands
+static void emit_op(uint8_t instruction) {
+	emit_byte(instruction);
+	adjust_stack(stackEffects[instruction]);
+}
+
+static void emit_ops(uint8_t instruction1, uint8_t instruction2) {
+	emit_op(instruction1);
+	emit_op(instruction2);
+}
+
+//Call cache index operand, 16 bits
+//Functions with even more call sites share the last cache, it stays empty so those sites always miss
+static void emit_call_cache(void) {
+	int cache = CALL_CACHE_SHARED;
+	if (current->callSiteCount < CALL_CACHE_SHARED)
+		cache = current->callSiteCount++;
+	else
+		//Shared cache gets allocated too
+		current->callSiteCount = UINT16_COUNT;
+	emit_bytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
+static void emit_uint24(int value) {
+	emit_byte((value >> 16) & 0xff);
+	emit_byte((value >> 8) & 0xff);
+	emit_byte(value & 0xff);
+}
+
+//Emit instruction with a single index operand (constant, local or upvalue slot)
+//Compact 1 byte form when possible, else OP_WIDE prefix with a 24 bit operand
+static void emit_arg(uint8_t instruction, int arg) {
+	if (arg <= UINT8_MAX) {
+		emit_bytes(instruction, (uint8_t)arg);
+	} else {
+		emit_bytes(OP_WIDE, instruction);
+		emit_uint24(arg);
+	}
+	adjust_stack(stackEffects[instruction]);
+}
 
+static void emit_loop(int loopStart) {
 	//Offset to jump back
-	// +2 to jump over OP_LOOP operands (16bits)
-	int offset = current_chunk()->size - loopStart + 2;
-	if (offset > UINT16_MAX) 
+	// +3 to jump over OP_LOOP and it's operands (16bits)
+	int offset = current_chunk()->size - loopStart + 3;
+	if (offset <= UINT16_MAX) {
+		emit_op(OP_LOOP);
+		//Fill operands off OP_LOOP instruction with offset value
+		//Int -> 16bits
+		emit_byte((offset >> 8) & 0xff);
+		emit_byte(offset & 0xff);
+		return;
+	}
+
+	//Long loop body: OP_WIDE + OP_LOOP + 24 bit operand
+	offset += 2;
+	if (offset > UINT24_MAX)
 		error("Body of loop too large.");
-	//Fill operands off OP_LOOP instruction with offset value
-	//Int -> 16bits
-	emit_byte((offset >> 8) & 0xff);
-	emit_byte(offset & 0xff);
+	emit_bytes(OP_WIDE, OP_LOOP);
+	emit_uint24(offset);
 }
 
 static int emit_jump(uint8_t instruction) {
-	emit_byte(instruction);
+	emit_op(instruction);
 	//Fill operand with placeholder to "backpatch" later when we know real offset
 	//16 bit offset -> 65 535 bytes of code we can jump over max
+	//If the code gets bigger than that the jump gets routed through a wide jump island (see emit_jump_islands)
 	emit_byte(0xff);
 	emit_byte(0xff);
-	//return index (location) of instruction in code so we can patch later
-	return current_chunk()->size - 2;
+
+	if (current->jumpCapacity < current->jumpCount + 1) {
+		int oldCapacity = current->jumpCapacity;
+		current->jumpCapacity = GROW_CAPACITY(oldCapacity);
+		current->jumps = GROW_ARRAY(Jump, current->jumps, oldCapacity, current->jumpCapacity);
+	}
+
+	Jump* jump = &current->jumps[current->jumpCount];
+	jump->offset = current_chunk()->size - 2;
+	jump->depth = current->stackDepth;
+	jump->wide = false;
+	jump->patched = false;
+	//return handle of the jump so we can patch later
+	return current->jumpCount++;
 }
 
 static void emit_return(void) {
 	//Init function needs to return created instance which lives in slot 0 as a local var
 	if (current->type == TYPE_INITIALIZER) {
-		emit_bytes(OP_GET_LOCAL, 0);
+		emit_arg(OP_GET_LOCAL, 0);
 	}
 	else {
 		//Implicit return nil
-		emit_byte(OP_NIL);
+		emit_op(OP_NIL);
 	}
-	emit_byte(OP_RETURN);
+	emit_op(OP_RETURN);
 }
 
-static uint8_t make_constant(Value value) {
+static int make_constant(Value value) {
 	int constant = add_constant(current_chunk(), value);
-	if(constant > UINT8_MAX) {
+	if(constant > UINT24_MAX) {
 		error("Too many constants in 1 chunk.");
 		return 0;
 	}
 
-	return (uint8_t) constant;
+	return constant;
 }
 
 static void emit_constant(Value value) {
-	emit_bytes(OP_CONSTANT, make_constant(value));
+	emit_arg(OP_CONSTANT, make_constant(value));
 }
 
-static void patch_jump(int offset) {
+static void patch_jump(int handle) {
+	Jump* pending = &current->jumps[handle];
+	Chunk* chunk = current_chunk();
+	int offset = pending->offset;
 	//Get amount of bytes to jump if we need to skip then branch
 	// = land right after then branch
-	// -2 to adjust for the bytecode for the jump offset itself.
-	int jump = current_chunk()->size - offset - 2;
+	// -2 (or -3 for wide jumps) to adjust for the bytecode for the jump offset itself.
+	if (pending->wide) {
+		int jump = chunk->size - offset - 3;
+		if (jump > UINT24_MAX) {
+			error("Too much code to jump over.");
+		}
+		chunk->code[offset] = (jump >> 16) & 0xff;
+		chunk->code[offset + 1] = (jump >> 8) & 0xff;
+		chunk->code[offset + 2] = jump & 0xff;
+	} else {
+		int jump = chunk->size - offset - 2;
+		if (jump > UINT16_MAX) {
+			error("Too much code to jump over.");
+		}
+		//Patch jump instruction operand with calculated jump offset
+		//Fit int in 16bits
+		chunk->code[offset] = (jump >> 8) & 0xff;
+		chunk->code[offset + 1] = jump & 0xff;
+	}
+
+	pending->patched = true;
+	current->lastJumpTarget = chunk->size;
+	//Code after an unconditional jump is only reached through a jump, it starts with the stack the jump left
+	//If it can also be reached by falling through, both have the same depth
+	current->stackDepth = pending->depth;
+	//Jumps mostly get patched in reverse order (nesting), drop finished ones from the top so the list only holds open jumps
+	while (current->jumpCount > 0 && current->jumps[current->jumpCount - 1].patched) {
+		current->jumpCount--;
+	}
+}
+
+//Forward jumps are emitted with a 16 bit operand because we don't know the distance yet
+//Before an open jump gets out of range we place an island: a wide jump in the middle of the code that normal control flow skips over
+//The short jump gets patched to land on the island and the island's wide jump becomes the one to patch later
+//Called between statements and between the operands of an expression, so the short jumps of and / or get islands too
+//Nothing relies on the code before and after an operand being next to each other, the island's skip jump leaves the stack as it is
+static void emit_jump_islands(void) {
+	Chunk* chunk = current_chunk();
+	int islandCount = 0;
+	for (int i = 0; i < current->jumpCount; i++) {
+		Jump* jump = &current->jumps[i];
+		if (!jump->patched && !jump->wide && chunk->size - jump->offset > JUMP_ISLAND_DISTANCE) {
+			islandCount++;
+		}
+	}
+
+	if (islandCount == 0)
+		return;
+
+	//Jump over the islands: 5 bytes each (OP_WIDE + OP_JUMP + 24 bit operand)
+	int skip = islandCount * 5;
+	emit_op(OP_JUMP);
+	emit_byte((skip >> 8) & 0xff);
+	emit_byte(skip & 0xff);
 
-	if (jump > UINT16_MAX) {
-		error("Too much code to jump over.");
+	for (int i = 0; i < current->jumpCount; i++) {
+		Jump* jump = &current->jumps[i];
+		if (jump->patched || jump->wide || chunk->size - jump->offset <= JUMP_ISLAND_DISTANCE)
+			continue;
+
+		//Land the short jump on the island
+		int distance = chunk->size - jump->offset - 2;
+		chunk->code[jump->offset] = (distance >> 8) & 0xff;
+		chunk->code[jump->offset + 1] = distance & 0xff;
+
+		emit_bytes(OP_WIDE, OP_JUMP);
+		emit_uint24(UINT24_MAX);
+		jump->offset = chunk->size - 3;
+		jump->wide = true;
 	}
-	//Patch jump instruction operand with calculated jump offset
-	//Fit int in 16bits
-	current_chunk()->code[offset] = (jump >> 8) & 0xff;
-	current_chunk()->code[offset + 1] = jump & 0xff;
 }
 
 static void init_compiler(Compiler* compiler, FunctionType type) {
@@ -254,7 +449,23 @@ static void init_compiler(Compiler* compiler, FunctionType type) {
 	compiler->type = type;
 	compiler->localCount = 0;
 	compiler->scopeDepth = 0;
+	compiler->locals = NULL;
+	compiler->localCapacity = 0;
+	compiler->upvalues = NULL;
+	compiler->upvalueCapacity = 0;
+	compiler->jumps = NULL;
+	compiler->jumpCount = 0;
+	compiler->jumpCapacity = 0;
+	compiler->lastCall = -1;
+	compiler->lastCallEnd = -1;
+	compiler->lastProperty = -1;
+	compiler->lastPropertyEnd = -1;
+	compiler->lastJumpTarget = -1;
+	//Slot 0 is taken by the callee or receiver
+	compiler->stackDepth = 1;
+	compiler->callSiteCount = 0;
 	compiler->function = new_function();
+	compiler->function->maxStack = 1;
 	current = compiler;
 	//Store function name
 	if (type != TYPE_SCRIPT) {
@@ -266,9 +477,12 @@ static void init_compiler(Compiler* compiler, FunctionType type) {
 	//For fn calls that slot will hold the function being called
 	//Empty name so user cannot write an identifier that refers to it
 	//For method calls we store the receiver in the first slot
+	current->localCapacity = GROW_CAPACITY(0);
+	current->locals = GROW_ARRAY(Local, NULL, 0, current->localCapacity);
 	Local* local = &current->locals[current->localCount++];
 	local->depth = 0;
 	local->isCaptured = false;
+	local->isMethod = false;
 
 	if (type != TYPE_FUNCTION) {
 		local->name.start = "this";
@@ -283,6 +497,24 @@ static void init_compiler(Compiler* compiler, FunctionType type) {
 static ObjFunction* end_compiler(void) {
 	emit_return();
 	ObjFunction* function = current->function;
+	shrink_chunk(current_chunk());
+
+	//Allocate before setting the count so a GC during allocation does not walk a missing array
+	CallCache* callCaches = ALLOCATE(CallCache, current->callSiteCount);
+	for (int i = 0; i < current->callSiteCount; i++) {
+		callCaches[i].callee = NULL;
+		callCaches[i].closure = NULL;
+		callCaches[i].klass = NULL;
+		callCaches[i].native = NULL;
+#ifdef GC_PRETENURE
+		callCaches[i].site = 0;
+#endif
+	}
+	function->callCaches = callCaches;
+	function->callCacheCount = current->callSiteCount;
+
+	FREE_ARRAY(Local, current->locals, current->localCapacity);
+	FREE_ARRAY(Jump, current->jumps, current->jumpCapacity);
 
 #ifdef DEBUG_PRINT_CODE
 	if (!parser.hadError) {
@@ -307,13 +539,13 @@ static void end_scope(void) {
 
 		if (current->locals[current->localCount - 1].isCaptured) {
 			//If local var is captured in closure we hoist it to heap
-			emit_byte(OP_CLOSE_UPVALUE);
+			emit_op(OP_CLOSE_UPVALUE);
 		}
 		else {
 			//Local vars occupy spot on stack
 			//When it goes out of scope it is no longer needed
 			//Pop it off
-			emit_byte(OP_POP);
+			emit_op(OP_POP);
 		}
 
 		current->localCount--;
@@ -331,11 +563,13 @@ static void parse_precedence(Precedence precedence) {
 	//Only consume assignment ( = token ) if it is in context of a low-precedence expression
 	bool canAssign = precedence <= PREC_ASSIGNMENT;
 	prefixRule(canAssign);
+	emit_jump_islands();
 
 	while(precedence <= get_rule(parser.curr.type)->precedence){
 		advance();
 		ParseFn infixRule = get_rule(parser.prev.type)->infix;
 		infixRule(canAssign);
+		emit_jump_islands();
 	}
 
 	//If = didn't get consumed and we could assign it means we have wrong
@@ -346,7 +580,7 @@ static void parse_precedence(Precedence precedence) {
 	}
 }
 
-static uint8_t identifier_constant(Token* name) {
+static int identifier_constant(Token* name) {
 	//Global vars are looked up by name at runtime
 	//Whole string is too big to fit into bytecode
 	//Store string in constant table and instruction refers to the name by index in constant table
@@ -380,7 +614,7 @@ static int resolve_local(Compiler* compiler, Token* name) {
 	return -1;
 }
 
-static int add_upvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int add_upvalue(Compiler* compiler, uint16_t index, bool isLocal, bool byValue) {
 	int upvalueCount = compiler->function->upvalueCount;
 
 	for (int i = 0; i < upvalueCount; i++) {
@@ -390,39 +624,83 @@ static int add_upvalue(Compiler* compiler, uint8_t index, bool isLocal) {
 		}
 	}
 
-	if (upvalueCount == UINT8_COUNT) {
+	if (upvalueCount == UINT16_COUNT) {
 		error("Too many closure variables in function.");
 		return 0;
 	}
 
+	if (compiler->upvalueCapacity < upvalueCount + 1) {
+		int oldCapacity = compiler->upvalueCapacity;
+		compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+		compiler->upvalues = GROW_ARRAY(Upvalue, compiler->upvalues, oldCapacity, compiler->upvalueCapacity);
+	}
+
 	compiler->upvalues[upvalueCount].isLocal = isLocal;
 	compiler->upvalues[upvalueCount].index = index;
+	compiler->upvalues[upvalueCount].byValue = byValue;
 	return compiler->function->upvalueCount++;
 }
 
+//Collect every name that gets assigned to, before compiling
+//Compiler is single pass, when a closure captures a local it can't know yet if the local is assigned further down
+//Name based so variables sharing a name with an assigned one are treated as assigned too, which is always safe
+static void find_assigned_names(const char* source) {
+	init_scanner(source);
+	Token prev;
+	prev.type = TOKEN_EOF;
+	Token token = scan_token();
+	while (token.type != TOKEN_EOF) {
+		Token next = scan_token();
+		//name = value, not obj.name = value or var name = value
+		if (token.type == TOKEN_IDENTIFIER && next.type == TOKEN_EQUAL
+			&& prev.type != TOKEN_DOT && prev.type != TOKEN_VAR) {
+			//Grow the table first, a GC while growing would not see the new string yet
+			table_reserve(&assignedNames, assignedNames.size + 1);
+			table_set(&assignedNames, copy_string(token.start, token.length), NIL_VAL);
+		}
+		prev = token;
+		token = next;
+	}
+}
+
+//Looked up by the characters, interning a string just for the lookup could start a GC
+static bool is_assigned(Token* name) {
+	return table_find_string(&assignedNames, name->start, name->length, hash_string(name->start, name->length)) != NULL;
+}
+
 static int resolve_upvalue(Compiler* compiler, Token* name) {
 	if (compiler->enclosing == NULL) return -1;
 
 	int local = resolve_local((Compiler*)compiler->enclosing, name);
 	if (local != -1) {
-		compiler->enclosing->locals[local].isCaptured= true;
-		return add_upvalue(compiler, (uint8_t)local, true);
+		//Locals that never change get copied into the closure, no need to keep them alive in an ObjUpvalue
+		bool byValue = !is_assigned(name);
+		if (!byValue)
+			compiler->enclosing->locals[local].isCaptured = true;
+		return add_upvalue(compiler, (uint16_t)local, true, byValue);
 	}
 
 	int upvalue = resolve_upvalue((Compiler*)compiler->enclosing, name);
 	if (upvalue != -1) {
-		return add_upvalue(compiler, (uint8_t)upvalue, false);
+		bool byValue = compiler->enclosing->upvalues[upvalue].byValue;
+		return add_upvalue(compiler, (uint16_t)upvalue, false, byValue);
 	}
 	return -1;
 }
 
 static void add_local(Token name) {
 	//If max amount of locals -> error and return
-	if(current->localCount == UINT8_COUNT) {
+	if(current->localCount == UINT16_COUNT) {
 		error("Too many local variables in function.");
 		return;
 	}
 
+	if (current->localCapacity < current->localCount + 1) {
+		int oldCapacity = current->localCapacity;
+		current->localCapacity = GROW_CAPACITY(oldCapacity);
+		current->locals = GROW_ARRAY(Local, current->locals, oldCapacity, current->localCapacity);
+	}
+
 	//Initialize the next available Local in the locals array of vars
 	//Store variable name (identifier) and depth
 	Local* local = &current->locals[current->localCount++];
@@ -432,6 +710,7 @@ static void add_local(Token name) {
 	//Then we compile initializer, mark var as ready to use (initialized) if it does not point back to itself with an identifier in the expression (ex. var a = a;)
 	local->depth = -1;
 	local->isCaptured = false;
+	local->isMethod = false;
 }
 
 static void declare_variable(void) {
@@ -461,7 +740,7 @@ static void declare_variable(void) {
 	add_local(*name);
 }
 
-static uint8_t parse_variable(const char* errorMsg) {
+static int parse_variable(const char* errorMsg) {
 	consume(TOKEN_IDENTIFIER, errorMsg);
 	declare_variable();
 	//Local vars are not looked up by name at runtime
@@ -482,7 +761,7 @@ static void mark_initialized(void) {
 		current->scopeDepth;
 }
 
-static void define_variable(uint8_t global) {
+static void define_variable(int global) {
 	//Local vars are not looked up by name at runtime
 	//No need to put them in constant table
 	//Exit fn
@@ -491,7 +770,35 @@ static void define_variable(uint8_t global) {
 		return;
 	}
 
-	emit_bytes(OP_DEFINE_GLOBAL, global);
+	emit_arg(OP_DEFINE_GLOBAL, global);
+}
+
+//Bind the method of an unbound method local and store the result back, so every use after this sees the same object
+//Leaves the bound method on the stack
+static void emit_bind_method(int slot) {
+	emit_arg(OP_GET_LOCAL, slot - 1);
+	emit_arg(OP_GET_LOCAL, slot);
+	emit_op(OP_BIND_METHOD);
+	emit_arg(OP_SET_LOCAL, slot);
+}
+
+static uint8_t argument_list(void);
+
+//Use of an unbound method local
+static void method_variable(int slot) {
+	if (match(TOKEN_LEFT_PAREN)) {
+		//Receiver takes the callee slot, same as for OP_INVOKE
+		emit_arg(OP_GET_LOCAL, slot - 1);
+		uint8_t argCount = argument_list();
+		emit_arg(OP_GET_LOCAL, slot);
+		emit_bytes(OP_CALL_METHOD, argCount);
+		//Method and args get popped, result replaces the receiver
+		adjust_stack(-argCount - 1);
+		return;
+	}
+
+	//Anything else can let the method escape, it needs a real bound method
+	emit_bind_method(slot);
 }
 
 static uint8_t argument_list(void) {
@@ -518,7 +825,7 @@ static void and_(bool canAssign) {
 	//So skip right hand and leave value on stack so result of entire expression is false (short circuit)
 	int endJump = emit_jump(OP_JUMP_IF_FALSE);
 	//If not false, discard value for left hand expression + parse right hand which becomes result of entire and expression
-	emit_byte(OP_POP);
+	emit_op(OP_POP);
 	parse_precedence(PREC_AND);
 	patch_jump(endJump);
 }
@@ -548,8 +855,10 @@ static void function(FunctionType type) {
 			if (current->function->arity > 255) {
 				error_at_current("Can't have more than 255 parameters.");
 			}
-			uint8_t constant = parse_variable("Expect parameter name");
+			int constant = parse_variable("Expect parameter name");
 			define_variable(constant);
+			//Args are already on the stack when the function starts
+			adjust_stack(1);
 		} while (match(TOKEN_COMMA));
 	}
 
@@ -558,20 +867,49 @@ static void function(FunctionType type) {
 	block();
 
 	ObjFunction* function = end_compiler();
-	emit_bytes(OP_CLOSURE, make_constant(OBJ_VAL(function)));
+	//Constant first, once it's in the table the function is safe from the GC
+	int constant = make_constant(OBJ_VAL(function));
+
+	//Closure gets a copy of captured unbound methods, bind them first
+	for (int i = 0; i < function->upvalueCount; i++) {
+		if (compiler.upvalues[i].isLocal && current->locals[compiler.upvalues[i].index].isMethod) {
+			emit_bind_method(compiler.upvalues[i].index);
+			emit_op(OP_POP);
+		}
+	}
+
+	emit_arg(OP_CLOSURE, constant);
+#ifdef GC_PRETENURE
+	//Allocation site of the closures
+	emit_call_cache();
+#endif
 
 	//Operand pairs per upvalue
+	//Flags byte + 1 byte index, or 2 byte index if the slot does not fit in 1 byte
 	for (int i = 0; i < function->upvalueCount; i++) {
-		emit_byte(compiler.upvalues[i].isLocal ? 1 : 0);
-		emit_byte(compiler.upvalues[i].index);
+		uint16_t index = compiler.upvalues[i].index;
+		uint8_t flags = compiler.upvalues[i].isLocal ? UPVALUE_LOCAL : 0;
+		if (compiler.upvalues[i].byValue)
+			flags |= UPVALUE_VALUE;
+		if (index > UINT8_MAX) {
+			emit_byte(flags | UPVALUE_WIDE);
+			emit_byte((index >> 8) & 0xff);
+		} else {
+			emit_byte(flags);
+		}
+		emit_byte(index & 0xff);
 	}
+
+	FREE_ARRAY(Upvalue, compiler.upvalues, compiler.upvalueCapacity);
 }
 
 static void method(void) {
 	//Get method name
 	consume(TOKEN_IDENTIFIER, "Expect method name.");
 	//Add to constant table and get index
-	uint8_t constant = identifier_constant(&parser.prev);
+	int constant = identifier_constant(&parser.prev);
+	//Number method names as we find them so vtables stay dense
+	selector_id(AS_STRING(current_chunk()->constants.values[constant]));
 
 	//Compiles method parameter list and function body
 	//Emits code to create a closure and leave it on top of stack
@@ -586,7 +924,7 @@ static void method(void) {
 	}
 
 	function(type);
-	emit_bytes(OP_METHOD, constant);
+	emit_arg(OP_METHOD, constant);
 }
 
 static void class_declaration(void) {
@@ -594,12 +932,15 @@ static void class_declaration(void) {
 	//Class to bind methods to
 	Token className = parser.prev;
 	//Add class name to surrounding function constant table as a string
-	uint8_t nameConstant = identifier_constant(&parser.prev);
+	int nameConstant = identifier_constant(&parser.prev);
 	//Bind class object to name
 	declare_variable();
 	//Create class object at runtime
 	//Constant table index of the class's name as an operand
-	emit_bytes(OP_CLASS, nameConstant);
+	emit_arg(OP_CLASS, nameConstant);
+#ifdef GC_PRETENURE
+	emit_call_cache();
+#endif
 	//Define variable before body
 	//Refer to the containing class inside the bodies of its own methods
 	define_variable(nameConstant);
@@ -632,7 +973,7 @@ static void class_declaration(void) {
 		//Load subclass on stack
 		named_variable(className, false);
 		//Wire up superclass to subclass
-		emit_byte(OP_INHERIT);
+		emit_op(OP_INHERIT);
 		classCompiler.hasSuperclass = true;
 	}
 
@@ -652,7 +993,7 @@ static void class_declaration(void) {
 	}
 	consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
 	//Pop class off when we don't need it anymore (after method parsing)
-	emit_byte(OP_POP);
+	emit_op(OP_POP);
 
 	//Close local scope to store super class after all methods have been compiled
 	//This way every method has access to the superclass
@@ -666,7 +1007,7 @@ static void class_declaration(void) {
 
 static void fun_declaration(void) {
 	//Get function name
-	uint8_t global = parse_variable("Expect function name.");
+	int global = parse_variable("Expect function name.");
 	//Can't call function and execute the body until after it is fully defined
 	//Can instantly init - this means we can also refer to it inside fn (recursion)
 	mark_initialized();
@@ -674,15 +1015,37 @@ static void fun_declaration(void) {
 	define_variable(global);
 }
 
+//Turn the local just declared for var f = obj.m; into an unbound method, the initializer just emitted it's OP_GET_PROPERTY
+static void method_local(Token name) {
+	current_chunk()->code[current->lastProperty] = OP_GET_METHOD;
+	adjust_stack(1);
+
+	//Receiver keeps the slot the variable was declared in, under a name nobody can refer to
+	Local* receiver = &current->locals[current->localCount - 1];
+	receiver->name.start = "";
+	receiver->name.length = 0;
+	receiver->depth = current->scopeDepth;
+
+	add_local(name);
+	current->locals[current->localCount - 1].isMethod = true;
+}
+
 static void var_declaration(void) {
-	uint8_t global = parse_variable("Expect variable name.");
+	int global = parse_variable("Expect variable name.");
+	Token name = parser.prev;
 
 	if(match(TOKEN_EQUAL)) {
 		expression();
+		//Initializer ends in a property access nothing jumps past, and the variable is never assigned: no need to bind the method
+		Chunk* chunk = current_chunk();
+		if (current->scopeDepth > 0 && current->lastPropertyEnd == chunk->size
+			&& current->lastJumpTarget != chunk->size && !is_assigned(&name)) {
+			method_local(name);
+		}
 	}else {
 		//Init to nil if no expression
 		//var myVar;
-		emit_byte(OP_NIL);
+		emit_op(OP_NIL);
 	}
 	consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 	define_variable(global);
@@ -694,7 +1057,7 @@ static void expression_statement(void) {
 	//Make sure to remove it from stack
 	//Statements have a net-0 effect on state of stack
 	//= Evaluate expression and discard result
-	emit_byte(OP_POP);
+	emit_op(OP_POP);
 }
 
 static void for_statement(void) {
@@ -719,7 +1082,7 @@ static void for_statement(void) {
 
 		// Jump out of the loop if the condition is false.
 		exitJump = emit_jump(OP_JUMP_IF_FALSE);
-		emit_byte(OP_POP); // Condition.
+		emit_op(OP_POP); // Condition.
 	}
 
 	//Increment clause
@@ -731,7 +1094,7 @@ static void for_statement(void) {
 		//Increment expression
 		expression();
 		//Usually assigment, so we only care about side effect, not value on stack -> pop off
-		emit_byte(OP_POP);
+		emit_op(OP_POP);
 		consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 		//Jump to start of loop (before cond check) right after executing the increment clause
 		emit_loop(loopStart);
@@ -746,7 +1109,7 @@ static void for_statement(void) {
 	//Only if cond clause is there
 	if (exitJump != -1) {
 		patch_jump(exitJump);
-		emit_byte(OP_POP); // Condition.
+		emit_op(OP_POP); // Condition.
 	}
 
 	end_scope();
@@ -768,13 +1131,13 @@ static void if_statement(void) {
 	//Replace placeholder
 	int thenJump = emit_jump(OP_JUMP_IF_FALSE);
 	//Make sure cond var gets popped off once: in then
-	emit_byte(OP_POP);
+	emit_op(OP_POP);
 	statement();
 	int elseJump = emit_jump(OP_JUMP);
 
 	patch_jump(thenJump);
 	//Make sure cond var gets popped off once: or in else
-	emit_byte(OP_POP);
+	emit_op(OP_POP);
 
 	//Compile else branch if there
 	//IF cond = false we jump to else
@@ -788,7 +1151,7 @@ static void if_statement(void) {
 static void print_statement(void) {
 	expression();
 	consume(TOKEN_SEMICOLON, "Expect ';' after value");
-	emit_byte(OP_PRINT);
+	emit_op(OP_PRINT);
 }
 
 static void return_statement(void) {
@@ -805,7 +1168,15 @@ static void return_statement(void) {
 		}
 		expression();
 		consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-		emit_byte(OP_RETURN);
+
+		//Return value is the result of a call: turn it into a tail call
+		//Other paths through the expression (and / or) jump past it and still hit the OP_RETURN
+		Chunk* chunk = current_chunk();
+		if (current->lastCallEnd == chunk->size) {
+			uint8_t* op = &chunk->code[current->lastCall];
+			*op = *op == OP_CALL ? OP_TAIL_CALL : OP_TAIL_INVOKE;
+		}
+		emit_op(OP_RETURN);
 	}
 }
 
@@ -819,12 +1190,12 @@ static void while_statement(void) {
 
 	//Jump over body if cond is false and take care of cond value on stack on either path
 	int exitJump = emit_jump(OP_JUMP_IF_FALSE);
-	emit_byte(OP_POP);
+	emit_op(OP_POP);
 	statement();
 	//Jump back to start instructions again starting with the cond check
 	emit_loop(loopStart);
 	patch_jump(exitJump);
-	emit_byte(OP_POP);
+	emit_op(OP_POP);
 }
 
 static void synchronize(void) {
@@ -856,6 +1227,7 @@ static void synchronize(void) {
 }
 
 static void declaration(void) {
+	emit_jump_islands();
 
 	if(match(TOKEN_CLASS)) {
 		class_declaration();
@@ -874,6 +1246,8 @@ static void declaration(void) {
 }
 
 static void statement(void) {
+	emit_jump_islands();
+
 	if(match(TOKEN_PRINT)) {
 		print_statement();
 	}
@@ -921,7 +1295,7 @@ static void or_(bool canAssign) {
 
 	patch_jump(elseJump);
 	//Pop value off and compile right hand
-	emit_byte(OP_POP);
+	emit_op(OP_POP);
 	parse_precedence(PREC_OR);
 	patch_jump(endJump);
 }
@@ -931,6 +1305,11 @@ static void named_variable(Token name, bool canAssign) {
 	uint8_t getOp, setOp;
 	//Look for local var first
 	int arg = resolve_local(current, &name);
+	//Unbound method, never assigned so no setter needed
+	if (arg != -1 && current->locals[arg].isMethod) {
+		method_variable(arg);
+		return;
+	}
 	//Local var
 	if (arg != -1) {
 		getOp = OP_GET_LOCAL;
@@ -938,7 +1317,8 @@ static void named_variable(Token name, bool canAssign) {
 	}
 	//Local scope of enclosing functions
 	else if((arg = resolve_upvalue(current, &name)) != -1) {
-		getOp = OP_GET_UPVALUE;
+		//Captured by value only if the name is never assigned, so setOp won't be used then
+		getOp = current->upvalues[arg].byValue ? OP_GET_CAPTURED : OP_GET_UPVALUE;
 		setOp = OP_SET_UPVALUE;
 	}
 	//Global var
@@ -951,11 +1331,11 @@ static void named_variable(Token name, bool canAssign) {
 	//Assign expr to var
 	if (canAssign && match(TOKEN_EQUAL)) {
 		expression();
-		emit_bytes(setOp, (uint8_t)arg);
+		emit_arg(setOp, arg);
 	}
 	//Read var
 	else {
-		emit_bytes(getOp, (uint8_t)arg);
+		emit_arg(getOp, arg);
 	}
 }
 
@@ -984,7 +1364,7 @@ static void super_(bool canAssign) {
 	consume(TOKEN_DOT, "Expect '.' after 'super'.");
 	consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
 	//Store method name in constant table to look up at runtime
-	uint8_t name = identifier_constant(&parser.prev);
+	int name = identifier_constant(&parser.prev);
 	//Need receiver to call super on current instance
 	named_variable(synthetic_token("this"), false);
 
@@ -995,13 +1375,16 @@ static void super_(bool canAssign) {
 		uint8_t argCount = argument_list();
 		//Push superclass on stack
 		named_variable(synthetic_token("super"), false);
-		//2 operands: method name and arg count
-		emit_bytes(OP_SUPER_INVOKE, name);
+		//3 operands: method name, arg count and call cache
+		emit_arg(OP_SUPER_INVOKE, name);
 		emit_byte(argCount);
+		emit_call_cache();
+		adjust_stack(-argCount);
 	} else {
 		//Supercall is just an access
 		named_variable(synthetic_token("super"), false);
-		emit_bytes(OP_GET_SUPER, name);
+		emit_arg(OP_GET_SUPER, name);
+		emit_call_cache();
 	}
 }
 
@@ -1033,8 +1416,8 @@ static void unary(bool canAssign) {
 
 	//Emit negate bytecode after operand has been parsed and emitted into bytecode
 	switch (operatorType) {
-		case TOKEN_BANG: emit_byte(OP_NOT); break;
-		case TOKEN_MINUS: emit_byte(OP_NEGATE); break;
+		case TOKEN_BANG: emit_op(OP_NOT); break;
+		case TOKEN_MINUS: emit_op(OP_NEGATE); break;
 		default: return;
 	}
 
@@ -1053,16 +1436,16 @@ static void binary(bool canAssign) {
 	parse_precedence((Precedence)(rule->precedence + 1));
 
 	switch (operatorType) {
-		case TOKEN_BANG_EQUAL:    emit_bytes(OP_EQUAL, OP_NOT); break;
-		case TOKEN_EQUAL_EQUAL:   emit_byte(OP_EQUAL); break;
-		case TOKEN_GREATER:       emit_byte(OP_GREATER); break;
-		case TOKEN_GREATER_EQUAL: emit_bytes(OP_LESS, OP_NOT); break;
-		case TOKEN_LESS:          emit_byte(OP_LESS); break;
-		case TOKEN_LESS_EQUAL:    emit_bytes(OP_GREATER, OP_NOT); break;
-		case TOKEN_PLUS:          emit_byte(OP_ADD); break;
-		case TOKEN_MINUS:         emit_byte(OP_SUBTRACT); break;
-		case TOKEN_STAR:          emit_byte(OP_MULTIPLY); break;
-		case TOKEN_SLASH:         emit_byte(OP_DIVIDE); break;
+		case TOKEN_BANG_EQUAL:    emit_ops(OP_EQUAL, OP_NOT); break;
+		case TOKEN_EQUAL_EQUAL:   emit_op(OP_EQUAL); break;
+		case TOKEN_GREATER:       emit_op(OP_GREATER); break;
+		case TOKEN_GREATER_EQUAL: emit_ops(OP_LESS, OP_NOT); break;
+		case TOKEN_LESS:          emit_op(OP_LESS); break;
+		case TOKEN_LESS_EQUAL:    emit_ops(OP_GREATER, OP_NOT); break;
+		case TOKEN_PLUS:          emit_op(OP_ADD); break;
+		case TOKEN_MINUS:         emit_op(OP_SUBTRACT); break;
+		case TOKEN_STAR:          emit_op(OP_MULTIPLY); break;
+		case TOKEN_SLASH:         emit_op(OP_DIVIDE); break;
 		default: return;
 	}
 }
@@ -1070,15 +1453,22 @@ static void binary(bool canAssign) {
 static void call(bool canAssign) {
 	uint8_t argCount = argument_list();
 	emit_bytes(OP_CALL, argCount);
+	//Callee + args get replaced by the result
+	adjust_stack(-argCount);
+
+	emit_call_cache();
+
+	current->lastCall = current_chunk()->size - 4;
+	current->lastCallEnd = current_chunk()->size;
 }
 
 static void dot(bool canAssign) {
 	consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-	uint8_t name = identifier_constant(&parser.prev);
+	int name = identifier_constant(&parser.prev);
 
 	if(canAssign && match(TOKEN_EQUAL)) {
 		expression();
-		emit_bytes(OP_SET_PROPERTY, name);
+		emit_arg(OP_SET_PROPERTY, name);
 	}
 	//Optimize method calls
 	//Instead of treating every method call as 2 separate operations (access method + calling the result) which results in lots of heap allocations
@@ -1089,20 +1479,27 @@ static void dot(bool canAssign) {
 		uint8_t argCount = argument_list();
 		//2 operands, name + arg count
 		//It combines OP_GET_PROPERTY + OP_CALL
-		emit_bytes(OP_INVOKE, name);
+		//Skip the OP_WIDE prefix if there is one
+		current->lastCall = current_chunk()->size + (name > UINT8_MAX ? 1 : 0);
+		emit_arg(OP_INVOKE, name);
 		emit_byte(argCount);
+		adjust_stack(-argCount);
+		current->lastCallEnd = current_chunk()->size;
 	}
 	else {
-		emit_bytes(OP_GET_PROPERTY, name);
+		//Skip the OP_WIDE prefix if there is one
+		current->lastProperty = current_chunk()->size + (name > UINT8_MAX ? 1 : 0);
+		emit_arg(OP_GET_PROPERTY, name);
+		current->lastPropertyEnd = current_chunk()->size;
 	}
 	
 }
 
 static void literal(bool canAssign) {
 	switch (parser.prev.type) {
-		case TOKEN_FALSE: emit_byte(OP_FALSE); break;
-		case TOKEN_NIL: emit_byte(OP_NIL); break;
-		case TOKEN_TRUE: emit_byte(OP_TRUE); break;
+		case TOKEN_FALSE: emit_op(OP_FALSE); break;
+		case TOKEN_NIL: emit_op(OP_NIL); break;
+		case TOKEN_TRUE: emit_op(OP_TRUE); break;
 		default: return; 
 	}
 }
@@ -1155,6 +1552,9 @@ static ParseRule* get_rule(TokenType type) {
 }
 
 ObjFunction* compile(const char* source) {
+	init_table(&assignedNames);
+	find_assigned_names(source);
+
 	init_scanner(source);
 	Compiler compiler; init_compiler(&compiler, TYPE_SCRIPT);
 	
@@ -1168,6 +1568,7 @@ ObjFunction* compile(const char* source) {
 	}
 
 	ObjFunction* function = end_compiler();
+	free_table(&assignedNames);
 	return parser.hadError ? NULL : function;
 }
 
@@ -1177,4 +1578,5 @@ void mark_compiler_roots(void) {
 		mark_object((Obj*)compiler->function);
 		compiler = compiler->enclosing;
 	}
+	mark_table(&assignedNames);
 }
\ No newline at end of file
@@ -36,6 +36,27 @@ static int invoke_instruction(const char* name, Chunk* chunk,
 	return offset + 3;
 }
 
+static int super_instruction(const char* name, Chunk* chunk, int offset) {
+	uint8_t constant = chunk->code[offset + 1];
+	uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+	cache |= chunk->code[offset + 3];
+	printf("%-16s %4d '", name, constant);
+	print_value(chunk->constants.values[constant]);
+	printf("' cache %d\n", cache);
+	return offset + 4;
+}
+
+static int super_invoke_instruction(const char* name, Chunk* chunk, int offset) {
+	uint8_t constant = chunk->code[offset + 1];
+	uint8_t argCount = chunk->code[offset + 2];
+	uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+	cache |= chunk->code[offset + 4];
+	printf("%-16s (%d args) %4d '", name, argCount, constant);
+	print_value(chunk->constants.values[constant]);
+	printf("' cache %d\n", cache);
+	return offset + 5;
+}
+
 static int simple_instruction(const char* name, int offset) {
 	printf("%s\n", name);
 	return offset + 1;
@@ -47,6 +68,14 @@ static int byte_instruction(const char* name, Chunk* chunk,int offset) {
 	return offset + 2;
 }
 
+static int call_instruction(const char* name, Chunk* chunk, int offset) {
+	uint8_t argCount = chunk->code[offset + 1];
+	uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+	cache |= chunk->code[offset + 3];
+	printf("%-16s (%d args) cache %d\n", name, argCount, cache);
+	return offset + 4;
+}
+
 static int jump_instruction(const char* name, int sign, Chunk* chunk, int offset) {
 	uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
 	jump |= chunk->code[offset + 2];
@@ -55,13 +84,141 @@ static int jump_instruction(const char* name, int sign, Chunk* chunk, int offset
 	return offset + 3;
 }
 
+static int closure_instruction(const char* name, Chunk* chunk, int offset, uint32_t constant) {
+	printf("%-16s %4d ", name, constant);
+	print_value(chunk->constants.values[constant]);
+#ifdef GC_PRETENURE
+	//Cache of the allocation site comes before the upvalues
+	printf(" cache %d", (chunk->code[offset] << 8) | chunk->code[offset + 1]);
+	offset += 2;
+#endif
+	printf("\n");
+
+	ObjFunction* function = AS_FUNCTION(
+		chunk->constants.values[constant]);
+	for (int j = 0; j < function->upvalueCount; j++) {
+		int start = offset;
+		int flags = chunk->code[offset++];
+		int index = chunk->code[offset++];
+		if (flags & UPVALUE_WIDE) {
+			index = (index << 8) | chunk->code[offset++];
+		}
+		printf("%04d      |                     %s %d%s\n",
+			start, (flags & UPVALUE_LOCAL) ? "local" : "upvalue", index,
+			(flags & UPVALUE_VALUE) ? " (value)" : "");
+	}
+	return offset;
+}
+
+//Offset is right after the name operand
+static int class_instruction(const char* name, Chunk* chunk, int offset, uint32_t constant) {
+	printf("%-16s %4d '", name, constant);
+	print_value(chunk->constants.values[constant]);
+#ifdef GC_PRETENURE
+	printf("' cache %d\n", (chunk->code[offset] << 8) | chunk->code[offset + 1]);
+	return offset + 2;
+#else
+	printf("'\n");
+	return offset;
+#endif
+}
+
+static const char* wide_name(uint8_t instruction) {
+	switch (instruction) {
+		case OP_CONSTANT:      return "OP_CONSTANT";
+		case OP_GET_LOCAL:     return "OP_GET_LOCAL";
+		case OP_SET_LOCAL:     return "OP_SET_LOCAL";
+		case OP_GET_GLOBAL:    return "OP_GET_GLOBAL";
+		case OP_DEFINE_GLOBAL: return "OP_DEFINE_GLOBAL";
+		case OP_SET_GLOBAL:    return "OP_SET_GLOBAL";
+		case OP_GET_UPVALUE:   return "OP_GET_UPVALUE";
+		case OP_SET_UPVALUE:   return "OP_SET_UPVALUE";
+		case OP_GET_CAPTURED:  return "OP_GET_CAPTURED";
+		case OP_GET_PROPERTY:  return "OP_GET_PROPERTY";
+		case OP_SET_PROPERTY:  return "OP_SET_PROPERTY";
+		case OP_GET_METHOD:    return "OP_GET_METHOD";
+		case OP_GET_SUPER:     return "OP_GET_SUPER";
+		case OP_JUMP:          return "OP_JUMP";
+		case OP_JUMP_IF_FALSE: return "OP_JUMP_IF_FALSE";
+		case OP_LOOP:          return "OP_LOOP";
+		case OP_INVOKE:        return "OP_INVOKE";
+		case OP_SUPER_INVOKE:  return "OP_SUPER_INVOKE";
+		case OP_TAIL_INVOKE:   return "OP_TAIL_INVOKE";
+		case OP_CLOSURE:       return "OP_CLOSURE";
+		case OP_CLASS:         return "OP_CLASS";
+		case OP_METHOD:        return "OP_METHOD";
+		default:               return "OP_WIDE ???";
+	}
+}
+
+//OP_WIDE prefixed instruction: same operands as the compact form but the first one is 24 bits
+static int wide_instruction(Chunk* chunk, int offset) {
+	uint8_t instruction = chunk->code[offset + 1];
+	const char* name = wide_name(instruction);
+	uint32_t arg = (uint32_t)(chunk->code[offset + 2] << 16) |
+		(chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+	int next = offset + 5;
+
+	switch (instruction) {
+		case OP_GET_LOCAL:
+		case OP_SET_LOCAL:
+		case OP_GET_UPVALUE:
+		case OP_SET_UPVALUE:
+		case OP_GET_CAPTURED:
+			printf("%-16s %4d (wide)\n", name, arg);
+			return next;
+
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+			printf("%-16s %4d -> %d (wide)\n", name, offset, next + arg);
+			return next;
+
+		case OP_LOOP:
+			printf("%-16s %4d -> %d (wide)\n", name, offset, next - arg);
+			return next;
+
+		case OP_INVOKE:
+		case OP_TAIL_INVOKE:
+			printf("%-16s (%d args) %4d '", name, chunk->code[next], arg);
+			print_value(chunk->constants.values[arg]);
+			printf("' (wide)\n");
+			return next + 1;
+
+		case OP_SUPER_INVOKE:
+			printf("%-16s (%d args) %4d '", name, chunk->code[next], arg);
+			print_value(chunk->constants.values[arg]);
+			printf("' cache %d (wide)\n", (chunk->code[next + 1] << 8) | chunk->code[next + 2]);
+			return next + 3;
+
+		case OP_GET_SUPER:
+			printf("%-16s %4d '", name, arg);
+			print_value(chunk->constants.values[arg]);
+			printf("' cache %d (wide)\n", (chunk->code[next] << 8) | chunk->code[next + 1]);
+			return next + 2;
+
+		case OP_CLOSURE:
+			return closure_instruction(name, chunk, next, arg);
+
+		case OP_CLASS:
+			return class_instruction(name, chunk, next, arg);
+
+		default:
+			//Remaining instructions take a constant table index
+			printf("%-16s %4d '", name, arg);
+			print_value(chunk->constants.values[arg]);
+			printf("' (wide)\n");
+			return next;
+	}
+}
+
 int disassemble_instruction(Chunk* chunk, int offset) {
 	printf("%04d ", offset);
 
-	if(offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+	int line = get_line(chunk, offset);
+	if(offset > 0 && line == get_line(chunk, offset - 1)) {
 		printf("   | ");
 	} else {
-		printf("%4d ", chunk->lines[offset]);
+		printf("%4d ", line);
 	}
 
 	uint8_t instruction = chunk->code[offset];
@@ -90,12 +247,18 @@ int disassemble_instruction(Chunk* chunk, int offset) {
 			return byte_instruction("OP_GET_UPVALUE", chunk, offset);
 		case OP_SET_UPVALUE:
 			return byte_instruction("OP_SET_UPVALUE", chunk, offset);
+		case OP_GET_CAPTURED:
+			return byte_instruction("OP_GET_CAPTURED", chunk, offset);
 		case OP_GET_PROPERTY:
 			return constant_instruction("OP_GET_PROPERTY", chunk, offset);
 		case OP_SET_PROPERTY:
 			return constant_instruction("OP_SET_PROPERTY", chunk, offset);
+		case OP_GET_METHOD:
+			return constant_instruction("OP_GET_METHOD", chunk, offset);
+		case OP_BIND_METHOD:
+			return simple_instruction("OP_BIND_METHOD", offset);
 		case OP_GET_SUPER:
-			return constant_instruction("OP_GET_SUPER", chunk, offset);
+			return super_instruction("OP_GET_SUPER", chunk, offset);
 		case OP_EQUAL:
 			return simple_instruction("OP_EQUAL", offset);
 		case OP_GREATER:
@@ -123,31 +286,24 @@ int disassemble_instruction(Chunk* chunk, int offset) {
 		case OP_LOOP:
 			return jump_instruction("OP_LOOP", -1, chunk, offset);
 		case OP_CALL:
-			return byte_instruction("OP_CALL", chunk, offset);
+			return call_instruction("OP_CALL", chunk, offset);
+		case OP_CALL_METHOD:
+			return byte_instruction("OP_CALL_METHOD", chunk, offset);
 
 		case OP_INVOKE:
 			return invoke_instruction("OP_INVOKE", chunk, offset);
 
 		case OP_SUPER_INVOKE:
-			return invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
-
-		case OP_CLOSURE: {
-			offset++;
-			uint8_t constant = chunk->code[offset++];
-			printf("%-16s %4d ", "OP_CLOSURE", constant);
-			print_value(chunk->constants.values[constant]);
-			printf("\n");
-
-			ObjFunction* function = AS_FUNCTION(
-				chunk->constants.values[constant]);
-			for (int j = 0; j < function->upvalueCount; j++) {
-				int isLocal = chunk->code[offset++];
-				int index = chunk->code[offset++];
-				printf("%04d      |                     %s %d\n",
-					offset - 2, isLocal ? "local" : "upvalue", index);
-			}
-			return offset;
-		}
+			return super_invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
+
+		case OP_TAIL_CALL:
+			return call_instruction("OP_TAIL_CALL", chunk, offset);
+
+		case OP_TAIL_INVOKE:
+			return invoke_instruction("OP_TAIL_INVOKE", chunk, offset);
+
+		case OP_CLOSURE:
+			return closure_instruction("OP_CLOSURE", chunk, offset + 2, chunk->code[offset + 1]);
 
 		case OP_CLOSE_UPVALUE:
 			return simple_instruction("OP_CLOSE_UPVALUE", offset);
@@ -156,7 +312,7 @@ int disassemble_instruction(Chunk* chunk, int offset) {
 			return simple_instruction("OP_RETURN", offset);
 
 		case OP_CLASS:
-			return constant_instruction("OP_CLASS", chunk, offset);
+			return class_instruction("OP_CLASS", chunk, offset + 2, chunk->code[offset + 1]);
 
 		case OP_INHERIT:
 			return simple_instruction("OP_INHERIT", offset);
@@ -164,6 +320,9 @@ int disassemble_instruction(Chunk* chunk, int offset) {
 		case OP_METHOD:
 			return constant_instruction("OP_METHOD", chunk, offset);
 
+		case OP_WIDE:
+			return wide_instruction(chunk, offset);
+
 		default:
 			printf("Unknown opcode %d\n", instruction);
 			return offset + 1;
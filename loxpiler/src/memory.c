@@ -1,5 +1,8 @@
 #include "memory.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "compiler.h"
 #include "object.h"
@@ -7,28 +10,114 @@
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+#ifdef GC_COMPRESSED_REFS
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
 
-void* reallocate(void* ptr, size_t oldCap, size_t newCap) {
+//Most regions the allocator sweeps to make room for new objects before it opens a new region
+#define LAZY_SWEEP_REGIONS 16
 
-	vm.bytesAllocated += newCap - oldCap;
+static void collect_everything(void);
+#ifdef GC_COMPRESSED_REFS
+static size_t heap_available(void);
+#endif
+#ifdef GC_INCREMENTAL
+static void begin_marking(void);
+static void finish_cycle(void);
+#endif
+
+#ifdef GC_COMPACT
+//Set while compact_heap() fixes references, forward() looks for moved old objects only then
+static bool compacting = false;
+#endif
+
+#ifdef GC_PARALLEL
+struct MarkWorker {
+	//Taken for every change, thieves only take it to steal
+	Mutex* lock;
+	//Gray objects are between head and tail, the owner works at the tail and thieves take from the head
+	int head;
+	int tail;
+	int capacity;
+	Obj** objects;
+	//Head and tail differ, thieves look at this before bothering with the lock
+	bool hasWork;
+	Thread* thread;
+};
+
+//Worker of the thread while a parallel collection is marking, NULL otherwise
+static THREAD_LOCAL MarkWorker* currentWorker = NULL;
+
+static void push_work(MarkWorker* worker, Obj* object);
+#endif
+
+#ifdef GC_CONCURRENT
+//Set on the marker thread, whatever it marks goes on vm.markerGray instead of vm.grayStack
+static THREAD_LOCAL bool onMarker = false;
+
+static void grow_gray(GrayStack* stack) {
+	if (stack->capacity < stack->count + 1) {
+		stack->capacity = GROW_CAPACITY(stack->capacity);
+		//Call to system realloc: Memory in graystack is not managed by GC
+		stack->objects = (Obj**)realloc(stack->objects, sizeof(Obj*) * stack->capacity);
+		if (stack->objects == NULL)
+			exit(1);
+	}
+}
+#endif
+
+//Allocation can't be refused, callers don't expect NULL
+//The program keeps running past the limit until it gets to a safepoint, run() stops it there
+static void out_of_memory(void) {
+	vm.outOfMemory = true;
+#ifdef GC_GENERATIONAL
+	vm.nurseryLimit = NULL;
+#endif
+}
 
-	if(newCap > oldCap) {
+//Heap is over the configured limit, or what's left of the reserve compressed references can address is running out
+static bool over_limit(void) {
+	if (vm.gcOptions.heapLimit != 0 && vm.bytesAllocated > vm.gcOptions.heapLimit)
+		return true;
+#ifdef GC_COMPRESSED_REFS
+	return heap_available() < HEAP_RESERVE_SLACK;
+#else
+	return false;
+#endif
+}
 
+//Heap is about to grow, vm.bytesAllocated already counts the new bytes
+static void before_growing(void) {
 #ifdef DEBUG_STRESS_GC
-		//Force GC on every memory allocation
-		collect_garbage();
+	//Force GC on every memory allocation
+	collect_garbage();
 #endif
-		//Collect garbage after threshold of max bytes allocated is reached and we are allocating memory
-		if (vm.bytesAllocated > vm.nextGC) {
-			collect_garbage();
-		}
+	//Collect garbage after threshold of max bytes allocated is reached and we are allocating memory
+	if (vm.bytesAllocated > vm.nextGC) {
+		collect_garbage();
+	}
+
+	//Once it's out of memory the program is stopping anyway, don't collect everything again on every allocation until then
+	if (!vm.outOfMemory && over_limit()) {
+		collect_everything();
+		if (over_limit())
+			out_of_memory();
 	}
+}
 
+void* reallocate(void* ptr, size_t oldCap, size_t newCap) {
+
+	vm.bytesAllocated += newCap - oldCap;
+
+	if(newCap > oldCap)
+		before_growing();
 
 	if(newCap == 0) {
 		free(ptr);
@@ -37,25 +126,88 @@ void* reallocate(void* ptr, size_t oldCap, size_t newCap) {
 
 	void* result = realloc(ptr, newCap);
 
-	if (result == NULL) 
+	//System ran out before the heap limit did, what a full collection frees may be enough
+	if (result == NULL && newCap > oldCap) {
+		collect_everything();
+		result = realloc(ptr, newCap);
+	}
+	if (result == NULL) {
+		fprintf(stderr, "Out of memory.\n");
 		exit(1);
+	}
 
 	return result;
 }
 
-void mark_object(Obj* object) {
-	if (object == NULL) return;
-	//Break out cycles if already marked
-	if (object->isMarked) return;
+//Index of the lowest set bit, word is not 0
+static inline int lowest_bit(uint32_t word) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, word);
+	return (int)index;
+#else
+	return __builtin_ctz(word);
+#endif
+}
 
-#ifdef DEBUG_LOG_GC
-	printf("%p mark ", (void*)object);
-	print_value(OBJ_VAL(object));
-	printf("\n");
+//Set a bit other threads may be setting bits of the same word next to
+static inline void set_bit(uint32_t* word, uint32_t bit) {
+#if defined(GC_CONCURRENT) || defined(GC_PARALLEL)
+	bits_claim(word, bit);
+#else
+	*word |= bit;
+#endif
+}
+
+//Word of the object's mark bit in the bitmap beside it
+static uint32_t* mark_word(Obj* object, uint32_t* bit) {
+#ifdef GC_GENERATIONAL
+	if (is_young(object)) {
+		//Nursery objects are 8 byte aligned
+		size_t index = (size_t)((char*)object - vm.nursery) / 8;
+		*bit = (uint32_t)1 << (index % 32);
+		return &vm.nurseryMarks[index / 32];
+	}
 #endif
+	*bit = REGION_BIT(object);
+	return REGION_WORD(marks, object);
+}
 
-	object->isMarked = true;
+bool is_marked(Obj* object) {
+	uint32_t bit;
+	uint32_t* word = mark_word(object, &bit);
+	return (*word & bit) != 0;
+}
+
+//False if it was marked already
+static bool set_mark(Obj* object) {
+	uint32_t bit;
+	uint32_t* word = mark_word(object, &bit);
+#if defined(GC_CONCURRENT) || defined(GC_PARALLEL)
+	//Several threads can get here for the same object at once, only one of them gets true
+	return (bits_load(word) & bit) == 0 && bits_claim(word, bit);
+#else
+	if (*word & bit)
+		return false;
+	*word |= bit;
+	return true;
+#endif
+}
 
+static void push_gray(Obj* object) {
+#ifdef GC_PARALLEL
+	if (currentWorker != NULL) {
+		push_work(currentWorker, object);
+		return;
+	}
+#endif
+#ifdef GC_CONCURRENT
+	if (onMarker) {
+		grow_gray(&vm.markerGray);
+		vm.markerGray.objects[vm.markerGray.count++] = object;
+		return;
+	}
+#endif
 	if (vm.grayCapacity < vm.grayCount + 1) {
 		vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
 		//Call to system realloc: Memory in graystack is not managed by GC
@@ -67,6 +219,25 @@ void mark_object(Obj* object) {
 	vm.grayStack[vm.grayCount++] = object;
 }
 
+void mark_object(Obj* object) {
+	if (object == NULL) return;
+#if defined(GC_INCREMENTAL) && defined(GC_GENERATIONAL)
+	//Marking started with an empty nursery, anything in it now was allocated since and is not swept
+	//It moves at the next safepoint too, the gray stack can't hold on to it
+	if (is_young(object)) return;
+#endif
+	//Break out cycles if already marked
+	if (!set_mark(object)) return;
+
+#ifdef DEBUG_LOG_GC
+	printf("%p mark ", (void*)object);
+	print_value(OBJ_VAL(object));
+	printf("\n");
+#endif
+
+	push_gray(object);
+}
+
 void mark_value(Value value) {
 
 	//Only mark heap allocated objects (no need to free stack allocated objects)
@@ -88,11 +259,13 @@ static void blacken_object(Obj* object) {
 #endif
 
 	//Mark references based on obj type
-	switch (object->type) {
+	switch (obj_type(object)) {
 
 		case OBJ_CLASS: {
 			ObjClass* klass = (ObjClass*)object;
 			mark_object((Obj*)klass->name);
+			mark_object((Obj*)klass->initializer);
+			//vtable holds the same closures as methods, no need to mark those twice
 			mark_table(&klass->methods);
 			break;
 		}
@@ -113,9 +286,9 @@ static void blacken_object(Obj* object) {
 
 		case OBJ_CLOSURE: {
 			ObjClosure* closure = (ObjClosure*)object;
-			mark_object((Obj*)closure->function);
+			mark_object((Obj*)closure_function(closure));
 			for (int i = 0; i < closure->upvalueCount; i++) {
-				mark_object((Obj*)closure->upvalues[i]);
+				mark_value(closure->upvalues[i]);
 			}
 			break;
 		}
@@ -123,7 +296,13 @@ static void blacken_object(Obj* object) {
 		case OBJ_FUNCTION: {
 			ObjFunction* function = (ObjFunction*)object;
 			mark_object((Obj*)function->name);
+			mark_object((Obj*)function->closure);
 			mark_array(&function->chunk.constants);
+			for (int i = 0; i < function->callCacheCount; i++) {
+				mark_object(function->callCaches[i].callee);
+				mark_object((Obj*)function->callCaches[i].closure);
+				mark_object((Obj*)function->callCaches[i].klass);
+			}
 			break;
 		}
 
@@ -138,18 +317,14 @@ static void blacken_object(Obj* object) {
 	}
 }
 
-void free_object(Obj* obj) {
-
-#ifdef DEBUG_LOG_GC
-	printf("%p free type %d\n", (void*)obj, obj->type);
-#endif
-
-	switch (obj->type) {
+//Free what the object owns besides itself
+static void free_object_data(Obj* obj) {
+	switch (obj_type(obj)) {
 
 		case OBJ_CLASS: {
 			ObjClass* klass = (ObjClass*)obj;
 			free_table(&klass->methods);
-			FREE(ObjClass, obj);
+			FREE_ARRAY(ObjClosure*, klass->vtable, klass->vtableSize);
 			break;
 		}
 
@@ -159,46 +334,32 @@ void free_object(Obj* obj) {
 			//Might be other references to those objects
 			//GC will take care of those
 			free_table(&instance->fields);
-			FREE(ObjInstance, obj);
 			break;
 		}
 
-		case OBJ_BOUND_METHOD:
-			//Does not own it's references so only free itself
-			FREE(ObjBoundMethod, obj);
-			break;
-
 		case OBJ_FUNCTION:
 			ObjFunction* fn = (ObjFunction*)obj;
 			free_chunk(&fn->chunk);
-			FREE(ObjFunction, obj);
+			FREE_ARRAY(CallCache, fn->callCaches, fn->callCacheCount);
 			//Let gc deal with name (string)
 			break;
 
-		case OBJ_CLOSURE:
-			//Only free ObjClosure itself not the ObjFunction
-			//Closure doesn't own the fn, could be multiple closures referencing same fn
-			ObjClosure* closure = (ObjClosure*)obj;
-			FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-			FREE(ObjClosure, obj);
-			break;
-
 		case OBJ_STRING:
 			ObjString* string = (ObjString*)obj;
 			FREE_ARRAY(char, string->chars, string->length + 1);
-			FREE(ObjString, obj);
 			break;
 
+		//Bound methods and closures don't own their references, the other objects they point to could be shared
+		//Upvalues of a closure are part of it's allocation
+		case OBJ_BOUND_METHOD:
+		case OBJ_CLOSURE:
 		case OBJ_NATIVE:
-			FREE(ObjNative, obj);
-			break;
-
 		case OBJ_UPVALUE:
-			FREE(ObjUpvalue, obj);
 			break;
 	}
 }
 
+
 void mark_roots(void) {
 	//Walk the VM's stack for locals and temporaries
 	for(Value* slot = vm.stack; slot < vm.stackTop; slot++) {
@@ -210,9 +371,9 @@ void mark_roots(void) {
 		mark_object((Obj*)vm.frames[i].closure);
 	}
 
-	//Mark open upvalues list 
-	for(ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
-		mark_object((Obj*) upvalue);
+	//Mark open upvalues, only slots in use can have one
+	for (int i = 0; i < vm.stackTop - vm.stack; i++) {
+		mark_object((Obj*)vm.openUpvalues[i]);
 	}
 
 	//Mark globals
@@ -224,70 +385,1479 @@ void mark_roots(void) {
 	mark_object((Obj*)vm.initString);
 }
 
+#ifdef GC_PARALLEL
+static void push_work(MarkWorker* worker, Obj* object) {
+	mutex_lock(worker->lock);
+	if (worker->capacity < worker->tail + 1) {
+		worker->capacity = GROW_CAPACITY(worker->capacity);
+		//Call to system realloc: Memory in graystack is not managed by GC
+		worker->objects = (Obj**)realloc(worker->objects, sizeof(Obj*) * worker->capacity);
+		if (worker->objects == NULL)
+			exit(1);
+	}
+	worker->objects[worker->tail++] = object;
+	flag_store(&worker->hasWork, true);
+	mutex_unlock(worker->lock);
+}
+
+//NULL once the worker's own objects are gone
+static Obj* pop_work(MarkWorker* worker) {
+	Obj* object = NULL;
+	mutex_lock(worker->lock);
+	if (worker->tail > worker->head)
+		object = worker->objects[--worker->tail];
+	if (worker->tail == worker->head) {
+		worker->head = worker->tail = 0;
+		flag_store(&worker->hasWork, false);
+	}
+	mutex_unlock(worker->lock);
+	return object;
+}
+
+//Take half of what another worker has, starting with the objects it pushed first
+static bool steal_work(MarkWorker* thief) {
+	int self = (int)(thief - vm.markWorkers);
+	Obj* stolen[GC_STEAL_MAX];
+
+	for (int i = 1; i < vm.markWorkerCount; i++) {
+		MarkWorker* victim = &vm.markWorkers[(self + i) % vm.markWorkerCount];
+		if (!flag_load(&victim->hasWork))
+			continue;
+
+		//Copy out first, holding 2 workers' locks at once could deadlock with a thief going the other way
+		mutex_lock(victim->lock);
+		int count = (victim->tail - victim->head + 1) / 2;
+		if (count > GC_STEAL_MAX)
+			count = GC_STEAL_MAX;
+		memcpy(stolen, victim->objects + victim->head, sizeof(Obj*) * count);
+		victim->head += count;
+		if (victim->tail == victim->head) {
+			victim->head = victim->tail = 0;
+			flag_store(&victim->hasWork, false);
+		}
+		mutex_unlock(victim->lock);
+
+		if (count == 0)
+			continue;
+		for (int j = 0; j < count; j++) {
+			push_work(thief, stolen[j]);
+		}
+		return true;
+	}
+	return false;
+}
+
+static bool any_work(void) {
+	for (int i = 0; i < vm.markWorkerCount; i++) {
+		if (flag_load(&vm.markWorkers[i].hasWork))
+			return true;
+	}
+	return false;
+}
+
+//Only workers with objects left push new ones and a worker is only counted idle once it's out of them
+//So when every worker is idle at once nothing is gray anymore
+static void mark_in_parallel(MarkWorker* worker) {
+	for (;;) {
+		Obj* object;
+		while ((object = pop_work(worker)) != NULL) {
+			blacken_object(object);
+		}
+		if (steal_work(worker))
+			continue;
+
+		counter_add(&vm.markIdle, 1);
+		for (;;) {
+			if (counter_load(&vm.markIdle) == vm.markWorkerCount)
+				return;
+			//Stop counting as idle before stealing, or the others could see everyone idle while it holds stolen objects
+			if (any_work()) {
+				counter_add(&vm.markIdle, -1);
+				break;
+			}
+			thread_yield();
+		}
+	}
+}
+
+static void mark_helper_main(void* arg) {
+	MarkWorker* worker = (MarkWorker*)arg;
+	currentWorker = worker;
+	int epoch = 0;
+
+	mutex_lock(vm.markLock);
+	for (;;) {
+		while (vm.markEpoch == epoch && !vm.markStop) {
+			cond_wait(vm.markStart, vm.markLock);
+		}
+		if (vm.markStop)
+			break;
+		epoch = vm.markEpoch;
+		mutex_unlock(vm.markLock);
+
+		mark_in_parallel(worker);
+
+		mutex_lock(vm.markLock);
+		vm.markFinished++;
+		cond_signal(vm.markDone);
+	}
+	mutex_unlock(vm.markLock);
+}
+
+void init_parallel(void) {
+	vm.markWorkerCount = vm.gcOptions.markThreads > 0 ? vm.gcOptions.markThreads : cpu_count();
+	//Call to system malloc: workers are not managed by GC
+	vm.markWorkers = (MarkWorker*)malloc(sizeof(MarkWorker) * vm.markWorkerCount);
+	if (vm.markWorkers == NULL)
+		exit(1);
+	vm.markLock = new_mutex();
+	vm.markStart = new_cond_var();
+	vm.markDone = new_cond_var();
+	vm.markEpoch = 0;
+	vm.markFinished = 0;
+	vm.markStop = false;
+	vm.markIdle = 0;
+
+	for (int i = 0; i < vm.markWorkerCount; i++) {
+		MarkWorker* worker = &vm.markWorkers[i];
+		worker->lock = new_mutex();
+		worker->head = 0;
+		worker->tail = 0;
+		worker->capacity = 0;
+		worker->objects = NULL;
+		worker->hasWork = false;
+		worker->thread = NULL;
+	}
+	//Worker 0 is the VM's thread
+	for (int i = 1; i < vm.markWorkerCount; i++) {
+		vm.markWorkers[i].thread = thread_start(mark_helper_main, &vm.markWorkers[i]);
+	}
+}
+
+static void stop_helpers(void) {
+	mutex_lock(vm.markLock);
+	vm.markStop = true;
+	cond_broadcast(vm.markStart);
+	mutex_unlock(vm.markLock);
+
+	for (int i = 0; i < vm.markWorkerCount; i++) {
+		MarkWorker* worker = &vm.markWorkers[i];
+		if (worker->thread != NULL)
+			thread_join(worker->thread);
+		free_mutex(worker->lock);
+		free(worker->objects);
+	}
+	free(vm.markWorkers);
+	free_cond_var(vm.markStart);
+	free_cond_var(vm.markDone);
+	free_mutex(vm.markLock);
+}
+#endif
+
 void trace_references(void) {
+#ifdef GC_PARALLEL
+	//Deal the roots out and let every worker go at them
+	for (int i = 0; i < vm.grayCount; i++) {
+		push_work(&vm.markWorkers[i % vm.markWorkerCount], vm.grayStack[i]);
+	}
+	vm.grayCount = 0;
+	vm.markIdle = 0;
+
+	mutex_lock(vm.markLock);
+	vm.markFinished = 0;
+	vm.markEpoch++;
+	cond_broadcast(vm.markStart);
+	mutex_unlock(vm.markLock);
+
+	currentWorker = &vm.markWorkers[0];
+	mark_in_parallel(currentWorker);
+	currentWorker = NULL;
+
+	//Helpers may still be looking at objects until they report back
+	mutex_lock(vm.markLock);
+	while (vm.markFinished < vm.markWorkerCount - 1) {
+		cond_wait(vm.markDone, vm.markLock);
+	}
+	mutex_unlock(vm.markLock);
+#else
 	//While worklist is not empty -> keep pulling out gray objects and traverse references
 	//These references become new gray values in the worklist to mark their references too
 	while(vm.grayCount > 0) {
 		Obj* obj = vm.grayStack[--vm.grayCount];
 		blacken_object(obj);
 	}
+#endif
+}
+
+#ifdef GC_COMPRESSED_REFS
+//Address space for the whole heap up front, nothing is committed yet
+static char* reserve_heap(void) {
+#ifdef _WIN32
+	return (char*)VirtualAlloc(NULL, HEAP_RESERVE, MEM_RESERVE, PAGE_NOACCESS);
+#else
+	void* heap = mmap(NULL, HEAP_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return heap == MAP_FAILED ? NULL : (char*)heap;
+#endif
+}
+
+static bool commit_heap(char* start, size_t size) {
+#ifdef _WIN32
+	return VirtualAlloc(start, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+#else
+	return mprotect(start, size, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+static void release_heap(void) {
+#ifdef _WIN32
+	VirtualFree(vm.heap, 0, MEM_RELEASE);
+#else
+	munmap(vm.heap, HEAP_RESERVE);
+#endif
+}
+
+void init_heap(void) {
+	vm.heap = reserve_heap();
+	if (vm.heap == NULL)
+		exit(1);
+	//Offset 0 is the NULL Ref
+	vm.heapTop = vm.heap + HEAP_GRANULE;
+	vm.heapCommitted = vm.heap;
+	for (int i = 0; i < HEAP_FREE_LISTS; i++) {
+		vm.heapFree[i] = NULL;
+	}
+	vm.heapLargeFree = NULL;
+	vm.heapFreeBytes = 0;
 }
 
-void sweep(void) {
-	Obj* prev = NULL;
-	Obj* object = vm.objects;
+//Lives in the first words of the freed block itself
+struct FreeBlock {
+	FreeBlock* next;
+	size_t size;
+};
 
-	//Walk the list of all allocated objects
-	while(object != NULL) {
-		if(object->isMarked) {
-			//Mark false for next GC
-			object->isMarked = false;
-			prev = object;
-			object = object->next;
-		} else {
-			Obj* trash = object;
-			object = object->next;
+static void heap_free(void* block, size_t size);
 
-			//Removing head or not
-			if(prev != NULL) {
-				prev->next = object;
-			} else {
-				vm.objects = object;
-			}
-			free_object(trash);
+//Reserve not handed out yet plus the freed blocks
+static size_t heap_available(void) {
+	return (size_t)(vm.heap + HEAP_RESERVE - vm.heapTop) + vm.heapFreeBytes;
+}
+
+//Block of the heap for the nursery, a region or a large object, NULL once the reserved space is used up
+//Freed blocks of the same size are reused, the heap itself only grows
+static void* heap_alloc(size_t size) {
+	size = (size + HEAP_GRANULE - 1) & ~(size_t)(HEAP_GRANULE - 1);
+	size_t list = size / HEAP_GRANULE;
+	if (list < HEAP_FREE_LISTS && vm.heapFree[list] != NULL) {
+		void* block = vm.heapFree[list];
+		vm.heapFree[list] = *(void**)block;
+		vm.heapFreeBytes -= size;
+		return block;
+	}
+	if (list >= HEAP_FREE_LISTS) {
+		//First fit, the rest of a bigger block is freed again
+		for (FreeBlock** link = &vm.heapLargeFree; *link != NULL; link = &(*link)->next) {
+			FreeBlock* block = *link;
+			if (block->size < size)
+				continue;
+			*link = block->next;
+			vm.heapFreeBytes -= block->size;
+			if (block->size > size)
+				heap_free((char*)block + size, block->size - size);
+			return block;
 		}
 	}
+
+	if (size > (size_t)(vm.heap + HEAP_RESERVE - vm.heapTop))
+		return NULL;
+	char* block = vm.heapTop;
+	if (block + size > vm.heapCommitted) {
+		size_t commit = (size_t)(block + size - vm.heapCommitted);
+		commit = (commit + HEAP_COMMIT_STEP - 1) / HEAP_COMMIT_STEP * HEAP_COMMIT_STEP;
+		if (commit > (size_t)(vm.heap + HEAP_RESERVE - vm.heapCommitted))
+			commit = (size_t)(vm.heap + HEAP_RESERVE - vm.heapCommitted);
+		if (!commit_heap(vm.heapCommitted, commit))
+			return NULL;
+		vm.heapCommitted += commit;
+	}
+	vm.heapTop += size;
+	return block;
 }
 
-void collect_garbage(void) {
-#ifdef DEBUG_LOG_GC
-	printf("-- gc begin\n");
-	size_t before = vm.bytesAllocated;
+static void heap_free(void* block, size_t size) {
+	size = (size + HEAP_GRANULE - 1) & ~(size_t)(HEAP_GRANULE - 1);
+	size_t list = size / HEAP_GRANULE;
+	vm.heapFreeBytes += size;
+	if (list >= HEAP_FREE_LISTS) {
+		FreeBlock* large = (FreeBlock*)block;
+		large->size = size;
+		large->next = vm.heapLargeFree;
+		vm.heapLargeFree = large;
+		return;
+	}
+	*(void**)block = vm.heapFree[list];
+	vm.heapFree[list] = block;
+}
+#else
+static void* heap_alloc(size_t size) {
+	//Call to system malloc: the nursery, regions and large objects are managed by the collector, not by reallocate
+	return malloc(size);
+}
+
+static void heap_free(void* block, size_t size) {
+	free(block);
+}
 #endif
 
-	mark_roots();
-	trace_references();
-	table_remove_white(&vm.strings);
-	sweep();
-	//Adjust threshold based on live memory * a grow factor
-	vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+static size_t region_size(int cellSize) {
+	size_t slotSize = cellSize == 0 ? sizeof(Obj*) : (size_t)cellSize;
+	return sizeof(Region) + slotSize * REGION_OBJECTS;
+}
+
+static Region* new_region(int sizeClass) {
+	int cellSize = sizeClass * REGION_GRANULE;
+	//Region and it's cells come out of the heap, objects in the cells have to be reachable by a Ref
+	Region* region = (Region*)heap_alloc(region_size(cellSize));
+	//With compressed references over_limit() stops the program long before the reserve is gone, only the slack is used up
+	if (region == NULL)
+		exit(1);
+	region->next = NULL;
+	memset(region->live, 0, sizeof(region->live));
+	memset(region->marks, 0, sizeof(region->marks));
+#ifdef GC_INCREMENTAL
+	memset(region->blacks, 0, sizeof(region->blacks));
+	memset(region->claims, 0, sizeof(region->claims));
+#endif
+#ifdef GC_GENERATIONAL
+	memset(region->remembered, 0, sizeof(region->remembered));
+#endif
+	region->liveCount = 0;
+	region->cellSize = cellSize;
+#ifdef GC_PRETENURE
+	region->tenured = false;
+#endif
+#ifdef GC_COMPACT
+	region->forwards = NULL;
+#endif
+	return region;
+}
+
+static Obj* region_object(Region* region, int slot) {
+	if (region->cellSize == 0)
+		return ((Obj**)region->cells)[slot];
+	return (Obj*)((char*)region->cells + (size_t)slot * region->cellSize);
+}
+
+//Regions at the head of the list that filled up move to the full list, allocation goes on with the next one
+static void retire_full(Region** list, Region** full) {
+	while (*list != NULL && (*list)->liveCount == REGION_OBJECTS) {
+		Region* region = *list;
+		*list = region->next;
+		region->next = *full;
+		*full = region;
+	}
+}
+
+//Swept region with room left becomes the one allocation fills if there is none, empty ones are given back
+static void reuse_region(Region* region) {
+	int sizeClass = region->cellSize / REGION_GRANULE;
+	Region** list = &vm.regions[sizeClass];
+	Region** full = &vm.fullRegions[sizeClass];
+#ifdef GC_PRETENURE
+	if (region->tenured) {
+		list = &vm.tenuredRegions[sizeClass];
+		full = &vm.tenuredFullRegions[sizeClass];
+	}
+#endif
+	if (region->liveCount == REGION_OBJECTS) {
+		region->next = *full;
+		*full = region;
+		return;
+	}
+
+	retire_full(list, full);
+	Region* head = *list;
+	if (head != NULL && region->liveCount == 0) {
+		heap_free(region, region_size(region->cellSize));
+		return;
+	}
+
+	if (head == NULL) {
+		region->next = NULL;
+		*list = region;
+	}
+	else {
+		region->next = head->next;
+		head->next = region;
+	}
+}
+
+#ifdef GC_COMPACT
+static int free_slots(Region* list) {
+	int count = 0;
+	for (Region* region = list; region != NULL; region = region->next) {
+		count += REGION_OBJECTS - region->liveCount;
+	}
+	return count;
+}
+
+//Large objects are allocated on their own, only size classes can free regions by moving objects
+static bool worth_compacting(void) {
+	for (int i = 1; i < REGION_CLASSES; i++) {
+		if (free_slots(vm.regions[i]) >= COMPACT_MIN_REGIONS * REGION_OBJECTS)
+			return true;
+	}
+	return false;
+}
+#endif
+
+//Pacer: the heap may grow by the configured ratio over the live bytes before the next collection
+//Never below the minimum heap and not past the limit
+static size_t next_threshold(size_t live) {
+	size_t next = (size_t)((double)live * vm.gcOptions.heapGrowth);
+	if (next < vm.gcOptions.minHeap)
+		next = vm.gcOptions.minHeap;
+
+	size_t limit = vm.gcOptions.heapLimit;
+	if (limit != 0 && vm.bytesAllocated < limit) {
+#ifdef GC_INCREMENTAL
+		//Program keeps allocating while a cycle runs, start halfway to the limit so the cycle can finish before it
+		limit = vm.bytesAllocated + (limit - vm.bytesAllocated) / 2;
+#endif
+		if (next > limit)
+			next = limit;
+	}
+	return next;
+}
+
+//Last region of a collection got swept, what's allocated now is what survived plus whatever got allocated since
+//Promotions fill the freed slots while the sweep runs, growing from all of that would double the heap every cycle
+static void sweep_done(void) {
+#ifdef GC_INCREMENTAL
+	vm.gcPhase = GC_IDLE;
+#endif
+	vm.nextGC = next_threshold(vm.survivedBytes);
+#ifdef DEBUG_LOG_GC
+	printf("-- gc end sweeping at %zu next at %zu\n", vm.bytesAllocated, vm.nextGC);
+#endif
+#ifdef GC_COMPACT
+	//Get to a safepoint soon, same as an incremental cycle waiting to start
+	if (worth_compacting()) {
+		vm.compactPending = true;
+		vm.nurseryLimit = NULL;
+	}
+#endif
+}
 
+//Object in the slot is dead, the slot itself is freed by clearing it's live bit
+static void free_slot(Region* region, int slot) {
+	Obj* object = region_object(region, slot);
 #ifdef DEBUG_LOG_GC
-	printf("-- gc end\n");
-	printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-		before - vm.bytesAllocated, before, vm.bytesAllocated,
-		vm.nextGC);
+	printf("%p free type %d\n", (void*)object, obj_type(object));
 #endif
+	free_object_data(object);
+	size_t size = object_size(object);
+	vm.bytesAllocated -= size;
+	vm.survivedBytes -= size;
+	if (region->cellSize == 0)
+		heap_free(object, size);
 }
 
-void free_objects(void) {
-	Obj* curr = vm.objects;
+//Free the dead objects of the next region waiting to be swept
+static void sweep_region(void) {
+	Region* region = vm.sweepRegions;
+	vm.sweepRegions = region->next;
+
+	//32 objects at a time, only the dead ones are looked at
+	for (int i = 0; i < REGION_WORDS; i++) {
+		uint32_t dead = region->live[i] & ~region->marks[i];
+		while (dead != 0) {
+			int slot = i * 32 + lowest_bit(dead);
+			dead &= dead - 1;
+			free_slot(region, slot);
+			region->liveCount--;
+		}
+		region->live[i] &= region->marks[i];
+	}
+
+	//Mark false for next GC
+	memset(region->marks, 0, sizeof(region->marks));
+#ifdef GC_INCREMENTAL
+	memset(region->blacks, 0, sizeof(region->blacks));
+	memset(region->claims, 0, sizeof(region->claims));
+#endif
+	reuse_region(region);
 
-	while(curr != NULL) {
-		Obj* trash = curr;
-		curr = curr->next;
-		free_object(trash);
+	if (vm.sweepRegions == NULL)
+		sweep_done();
+}
+
+static void finish_sweeping(void) {
+	while (vm.sweepRegions != NULL) {
+		sweep_region();
 	}
+}
 
-	free(vm.grayStack);
+//Every region of the lists goes on the sweep list
+static void sweep_later(Region** lists) {
+	for (int i = 0; i < REGION_CLASSES; i++) {
+		while (lists[i] != NULL) {
+			Region* region = lists[i];
+			lists[i] = region->next;
+			region->next = vm.sweepRegions;
+			vm.sweepRegions = region;
+		}
+	}
+}
+
+//Marking is over, everything allocated from here on goes in new regions and the sweeper works through the ones there now
+static void start_sweeping(void) {
+	vm.survivedBytes = vm.bytesAllocated;
+	sweep_later(vm.regions);
+	sweep_later(vm.fullRegions);
+#ifdef GC_PRETENURE
+	sweep_later(vm.tenuredRegions);
+	sweep_later(vm.tenuredFullRegions);
+#endif
+}
+
+//First free slot, region has room
+static int take_slot(Region* region) {
+	int word = 0;
+	while (region->live[word] == UINT32_MAX) {
+		word++;
+	}
+	int slot = word * 32 + lowest_bit(~region->live[word]);
+	region->live[word] |= (uint32_t)1 << (slot % 32);
+	region->liveCount++;
+	return slot;
+}
+
+//Room for an object outside the nursery, neither collects nor counts the bytes
+//Header already tells the sweeper where the object is, the caller fills in the rest
+static Obj* place_object(size_t size, bool tenured) {
+	int sizeClass = size <= REGION_CELL_MAX ? (int)((size + REGION_GRANULE - 1) / REGION_GRANULE) : 0;
+	Region** list = &vm.regions[sizeClass];
+	Region** full = &vm.fullRegions[sizeClass];
+#ifdef GC_PRETENURE
+	if (tenured) {
+		list = &vm.tenuredRegions[sizeClass];
+		full = &vm.tenuredFullRegions[sizeClass];
+	}
+#endif
+	retire_full(list, full);
+	if (*list == NULL) {
+		//Old generation needs room, pay for it by sweeping what the last collection left
+		//Regions of other size classes don't help this one, but they have to be swept before the next collection anyway
+		//Always the whole batch, stopping at the first region with room lets promotion refill the heap as fast as it's swept
+		for (int i = 0; i < LAZY_SWEEP_REGIONS && vm.sweepRegions != NULL; i++) {
+			sweep_region();
+		}
+
+		if (*list == NULL) {
+			Region* region = new_region(sizeClass);
+#ifdef GC_PRETENURE
+			region->tenured = tenured;
+#endif
+			region->next = *list;
+			*list = region;
+		}
+	}
+
+	Region* region = *list;
+	int slot = take_slot(region);
+	Obj* object;
+	if (sizeClass == 0) {
+		//Counted and collected like every other old object, but reallocate would start a collection
+		object = (Obj*)heap_alloc(size);
+		//Same as for a new region
+		if (object == NULL)
+			exit(1);
+		((Obj**)region->cells)[slot] = object;
+	}
+	else {
+		object = region_object(region, slot);
+	}
+	set_obj_region(object, region, slot);
+
+#ifdef GC_INCREMENTAL
+	//Objects allocated while marking survive the cycle, the marker is not going to look at them
+	if (allocate_black()) {
+		set_bit(REGION_WORD(marks, object), REGION_BIT(object));
+		set_bit(REGION_WORD(blacks, object), REGION_BIT(object));
+		set_bit(REGION_WORD(claims, object), REGION_BIT(object));
+	}
+#endif
+	return object;
+}
+
+//Object outside the nursery, same as reallocate it may collect first
+Obj* allocate_old(size_t size) {
+	vm.bytesAllocated += size;
+	before_growing();
+	return place_object(size, false);
+}
+
+#ifdef GC_PRETENURE
+//Same as allocate_old() but in the regions of long lived objects
+Obj* allocate_tenured(size_t size) {
+	vm.bytesAllocated += size;
+	before_growing();
+	return place_object(size, true);
+}
+
+int new_alloc_site(void) {
+	if (vm.siteCapacity < vm.siteCount + 1) {
+		vm.siteCapacity = GROW_CAPACITY(vm.siteCapacity);
+		//Call to system realloc: sites outlive the functions they belong to, they are not managed by GC
+		vm.sites = (AllocSite*)realloc(vm.sites, sizeof(AllocSite) * vm.siteCapacity);
+		if (vm.sites == NULL)
+			exit(1);
+	}
+
+	AllocSite* site = &vm.sites[vm.siteCount];
+	site->sampled = 0;
+	site->survived = 0;
+	site->tenured = false;
+	site->skipped = 0;
+	return vm.siteCount++;
+}
+
+//Objects of a tenured site are allocated old, except for the few that keep sampling it
+bool pretenure_site(int site) {
+	if (site == 0 || !vm.sites[site].tenured)
+		return false;
+	if (++vm.sites[site].skipped < PRETENURE_RESAMPLE)
+		return true;
+	vm.sites[site].skipped = 0;
+	return false;
+}
+
+void track_young_site(Obj* object, int site) {
+	if (vm.youngSiteCapacity < vm.youngSiteCount + 1) {
+		vm.youngSiteCapacity = GROW_CAPACITY(vm.youngSiteCapacity);
+		//Call to system realloc: collector's bookkeeping, not managed by it
+		vm.youngSites = (YoungSite*)realloc(vm.youngSites, sizeof(YoungSite) * vm.youngSiteCapacity);
+		if (vm.youngSites == NULL)
+			exit(1);
+	}
+
+	vm.youngSites[vm.youngSiteCount].object = object;
+	vm.youngSites[vm.youngSiteCount].site = site;
+	vm.youngSiteCount++;
+}
+
+//Promoted objects survived, the others are garbage
+//Has to run before the nursery is emptied, the forwarding in the headers is the only record of who got promoted
+static void count_survivors(void) {
+	for (int i = 0; i < vm.youngSiteCount; i++) {
+		AllocSite* site = &vm.sites[vm.youngSites[i].site];
+		site->sampled++;
+		if (obj_forwarding(vm.youngSites[i].object) != NULL)
+			site->survived++;
+
+		//Whole sample is in, decide for the next one
+		if (site->sampled == PRETENURE_SAMPLE) {
+			site->tenured = site->survived * 100 >= PRETENURE_SAMPLE * PRETENURE_SURVIVAL;
+			site->sampled = 0;
+			site->survived = 0;
+		}
+	}
+	vm.youngSiteCount = 0;
+}
+
+//Samples of a tenured site mostly end up stored in it's pretenured objects
+//Until a full collection takes a dead one out of the remembered set it keeps the samples alive, so they all look like survivors
+static void resample_sites(void) {
+	for (int i = 1; i < vm.siteCount; i++) {
+		vm.sites[i].sampled = 0;
+		vm.sites[i].survived = 0;
+		vm.sites[i].tenured = false;
+	}
+}
+#endif
+
+#ifdef GC_GENERATIONAL
+//Nursery is a sequence of objects, the size of one tells where the next starts
+static Obj* next_young(Obj* object) {
+	return (Obj*)((char*)object + NURSERY_ALIGN(object_size(object)));
+}
+
+//Remembered objects about to be swept
+static void forget_white(void) {
+	int count = 0;
+	for (int i = 0; i < vm.rememberedCount; i++) {
+		Obj* object = vm.remembered[i];
+		if (is_marked(object))
+			vm.remembered[count++] = object;
+		else
+			*REGION_WORD(remembered, object) &= ~REGION_BIT(object);
+	}
+	vm.rememberedCount = count;
+#ifdef GC_PRETENURE
+	//Dead objects are gone from the remembered set, sites can be sampled without them now
+	resample_sites();
+#endif
+}
+
+static void reset_nursery(void) {
+	vm.nurseryTop = vm.nursery;
+#ifdef DEBUG_STRESS_GC
+	//Minor collection at every safepoint that has something to collect
+	vm.nurseryLimit = vm.nursery;
+#else
+	vm.nurseryLimit = vm.nursery + NURSERY_SIZE - NURSERY_RESERVE;
+#endif
+}
+
+void init_nursery(void) {
+	//Objects in it are managed by minor collections, not by reallocate
+	vm.nursery = (char*)heap_alloc(NURSERY_SIZE);
+	vm.nurseryMarks = (uint32_t*)calloc(NURSERY_SIZE / 8 / 32, sizeof(uint32_t));
+	if (vm.nursery == NULL || vm.nurseryMarks == NULL)
+		exit(1);
+	reset_nursery();
+#ifdef GC_COMPACT
+	vm.compactPending = false;
+#endif
+	vm.rememberedCount = 0;
+	vm.rememberedCapacity = 0;
+	vm.remembered = NULL;
+#ifdef GC_PRETENURE
+	vm.sites = NULL;
+	vm.siteCount = 1;
+	vm.siteCapacity = 0;
+	vm.allocSite = 0;
+	vm.youngSiteCount = 0;
+	vm.youngSiteCapacity = 0;
+	vm.youngSites = NULL;
+#endif
+}
+
+//NULL if the object does not fit anymore, caller allocates it in the old generation then
+Obj* allocate_young(size_t size) {
+#ifdef DEBUG_STRESS_GC
+	//Keep the old generation collecting on every allocation too
+	collect_garbage();
+#endif
+	size = NURSERY_ALIGN(size);
+	if (size > (size_t)(vm.nursery + NURSERY_SIZE - vm.nurseryTop))
+		return NULL;
+
+	Obj* object = (Obj*)vm.nurseryTop;
+	vm.nurseryTop += size;
+	return object;
+}
+
+void remember_object(Obj* object) {
+	if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+		vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+		//Call to system realloc: remembered set is not managed by GC
+		vm.remembered = (Obj**)realloc(vm.remembered, sizeof(Obj*) * vm.rememberedCapacity);
+		if (vm.remembered == NULL)
+			exit(1);
+	}
+
+	*REGION_WORD(remembered, object) |= REGION_BIT(object);
+	vm.remembered[vm.rememberedCount++] = object;
+}
+
+//Move an object's contents into the slot copy got placed in
+static void copy_object(Obj* copy, Obj* object, size_t size) {
+	//Header of the original says nothing about where the copy is
+	Region* region = obj_region(copy);
+	int slot = obj_slot(copy);
+	memcpy(copy, object, size);
+	set_obj_region(copy, region, slot);
+
+	//Closed upvalue points at it's own field
+	if (obj_type(object) == OBJ_UPVALUE) {
+		ObjUpvalue* upvalue = (ObjUpvalue*)object;
+		if (upvalue->location == &upvalue->closed)
+			((ObjUpvalue*)copy)->location = &((ObjUpvalue*)copy)->closed;
+	}
+}
+
+//Copy a surviving young object into the old generation
+//The copy still points into the nursery, it goes on the gray stack to get those references fixed
+static Obj* promote(Obj* object) {
+	size_t size = object_size(object);
+	//Not allocate_old(), that could start a full collection in the middle of this one
+	Obj* copy = place_object(size, false);
+	vm.bytesAllocated += size;
+	copy_object(copy, object, size);
+
+	//Everyone else pointing at the young object finds the copy through here
+	set_obj_forwarding(object, copy);
+	push_gray(copy);
+
+#ifdef DEBUG_LOG_GC
+	printf("%p promote to %p ", (void*)object, (void*)copy);
+	print_value(OBJ_VAL(copy));
+	printf("\n");
+#endif
+	return copy;
+}
+
+//Where a reference points after the minor collection or compaction
+static Obj* forward(Obj* object) {
+	if (is_young(object)) {
+		Obj* copy = obj_forwarding(object);
+		if (copy != NULL)
+			return copy;
+		return promote(object);
+	}
+#ifdef GC_COMPACT
+	//Old object in a region compaction is emptying
+	if (compacting && object != NULL && obj_region(object)->forwards != NULL)
+		return obj_region(object)->forwards[obj_slot(object)];
+#endif
+	return object;
+}
+
+#define FORWARD(reference) ((reference) = (void*)forward((Obj*)(reference)))
+
+static void forward_value(Value* value) {
+	if (!IS_OBJ(*value))
+		return;
+	Obj* object = AS_OBJ(*value);
+	Obj* moved = forward(object);
+	if (moved != object)
+		*value = OBJ_VAL(moved);
+}
+
+static void forward_array(ValueArray* array) {
+	for (int i = 0; i < array->size; i++) {
+		forward_value(&array->values[i]);
+	}
+}
+
+//Keys keep their hash when they move, entries stay in the same bucket
+static void forward_table(Table* table) {
+	for (int i = 0; i < table->cap; i++) {
+		Entry* entry = &table->elements[i];
+		set_entry_key(entry, (ObjString*)forward((Obj*)entry_key(entry)));
+		//Packed entries don't keep the value aligned, no pointer to it
+		Value value = entry->value;
+		forward_value(&value);
+		entry->value = value;
+	}
+}
+
+//Same references blacken_object marks
+static void forward_references(Obj* object) {
+	switch (obj_type(object)) {
+
+		case OBJ_CLASS: {
+			ObjClass* klass = (ObjClass*)object;
+			FORWARD(klass->name);
+			FORWARD(klass->initializer);
+			forward_table(&klass->methods);
+			//Unlike marking the vtable needs it's own pass, it holds pointers that move too
+			for (int i = 0; i < klass->vtableSize; i++) {
+				FORWARD(klass->vtable[i]);
+			}
+			break;
+		}
+
+		case OBJ_INSTANCE: {
+			ObjInstance* instance = (ObjInstance*)object;
+			FORWARD(instance->klass);
+			forward_table(&instance->fields);
+			break;
+		}
+
+		case OBJ_BOUND_METHOD: {
+			ObjBoundMethod* bound = (ObjBoundMethod*)object;
+			forward_value(&bound->receiver);
+			FORWARD(bound->method);
+			break;
+		}
+
+		case OBJ_CLOSURE: {
+			ObjClosure* closure = (ObjClosure*)object;
+			set_closure_function(closure, (ObjFunction*)forward((Obj*)closure_function(closure)));
+			for (int i = 0; i < closure->upvalueCount; i++) {
+				forward_value(&closure->upvalues[i]);
+			}
+			break;
+		}
+
+		case OBJ_FUNCTION: {
+			ObjFunction* function = (ObjFunction*)object;
+			FORWARD(function->name);
+			FORWARD(function->closure);
+			forward_array(&function->chunk.constants);
+			for (int i = 0; i < function->callCacheCount; i++) {
+				FORWARD(function->callCaches[i].callee);
+				FORWARD(function->callCaches[i].closure);
+				FORWARD(function->callCaches[i].klass);
+			}
+			break;
+		}
+
+		case OBJ_UPVALUE:
+			forward_value(&((ObjUpvalue*)object)->closed);
+			break;
+
+		case OBJ_NATIVE:
+		case OBJ_STRING:
+			break;
+	}
+}
+
+//Compiler never runs at a safepoint, it's roots don't need to be looked at
+static void forward_roots(void) {
+	for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+		forward_value(slot);
+	}
+	for (int i = 0; i < vm.frameCount; i++) {
+		FORWARD(vm.frames[i].closure);
+	}
+	for (int i = 0; i < vm.stackTop - vm.stack; i++) {
+		FORWARD(vm.openUpvalues[i]);
+	}
+	forward_table(&vm.globals);
+	FORWARD(vm.initString);
+}
+
+//Promote everything in the nursery that is still reachable and empty it
+//Moves objects, so it only runs at safepoints in run() where no C local holds on to one
+static void minor_collection(void) {
+#ifdef DEBUG_LOG_GC
+	printf("-- minor gc begin\n");
+	size_t before = vm.bytesAllocated;
+#endif
+	int grayBase = vm.grayCount;
+	forward_roots();
+
+	//Only references from the old generation into the nursery that are not in the roots
+	for (int i = 0; i < vm.rememberedCount; i++) {
+		Obj* object = vm.remembered[i];
+		*REGION_WORD(remembered, object) &= ~REGION_BIT(object);
+		forward_references(object);
+	}
+	vm.rememberedCount = 0;
+
+	//Promoted objects may point at objects that have not been promoted yet
+	//They go on top of what incremental marking has on the gray stack
+	while (vm.grayCount > grayBase) {
+		forward_references(vm.grayStack[--vm.grayCount]);
+	}
+#ifdef GC_PRETENURE
+	count_survivors();
+#endif
+
+	//Interned strings are weak, the dead ones leave the strings table and the others are moved
+	//Everything else dead in the nursery only needs the memory it owns freed
+	for (Obj* object = (Obj*)vm.nursery; (char*)object < vm.nurseryTop; object = next_young(object)) {
+		Obj* copy = obj_forwarding(object);
+		if (copy != NULL) {
+			if (obj_type(object) == OBJ_STRING)
+				table_move_key(&vm.strings, (ObjString*)object, (ObjString*)copy);
+			continue;
+		}
+
+		if (obj_type(object) == OBJ_STRING)
+			table_delete(&vm.strings, (ObjString*)object);
+		free_object_data(object);
+	}
+	reset_nursery();
+
+#ifdef DEBUG_LOG_GC
+	printf("-- minor gc end\n");
+	printf("   old generation from %zu to %zu\n", before, vm.bytesAllocated);
+#endif
+}
+
+#ifdef GC_COMPACT
+static int by_live_count(const void* a, const void* b) {
+	return (*(Region**)a)->liveCount - (*(Region**)b)->liveCount;
+}
+
+//Move the objects of the emptiest regions of a size class into the free slots of the others
+//Emptied regions are added to evacuated, they have to stay around until every reference to them got forwarded
+static Region* evacuate_class(int sizeClass, Region* evacuated, int* moved) {
+	int count = 0;
+	int freeSlots = 0;
+	for (Region* region = vm.regions[sizeClass]; region != NULL; region = region->next) {
+		count++;
+		freeSlots += REGION_OBJECTS - region->liveCount;
+	}
+	if (freeSlots < REGION_OBJECTS)
+		return evacuated;
+
+	//Call to system malloc: collector's bookkeeping, not managed by it
+	Region** regions = (Region**)malloc(sizeof(Region*) * count);
+	if (regions == NULL)
+		exit(1);
+	count = 0;
+	for (Region* region = vm.regions[sizeClass]; region != NULL; region = region->next) {
+		regions[count++] = region;
+	}
+	qsort(regions, count, sizeof(Region*), by_live_count);
+
+	//Emptying a region takes away it's free slots and fills as many as it has objects, a region's worth of free slots in all
+	for (int i = 0; i < count && freeSlots >= REGION_OBJECTS; i++) {
+		regions[i]->forwards = (Obj**)malloc(sizeof(Obj*) * REGION_OBJECTS);
+		if (regions[i]->forwards == NULL)
+			exit(1);
+		freeSlots -= REGION_OBJECTS;
+	}
+
+	//Fullest regions get filled up first, whatever room is left ends up in as few regions as possible
+	int target = count - 1;
+	for (int i = 0; i < count; i++) {
+		Region* from = regions[i];
+		if (from->forwards == NULL)
+			continue;
+
+		for (int slot = 0; slot < REGION_OBJECTS; slot++) {
+			if (!(from->live[slot / 32] & ((uint32_t)1 << (slot % 32))))
+				continue;
+			while (regions[target]->forwards != NULL || regions[target]->liveCount == REGION_OBJECTS) {
+				target--;
+			}
+
+			Region* to = regions[target];
+			int toSlot = take_slot(to);
+			Obj* object = region_object(from, slot);
+			Obj* copy = region_object(to, toSlot);
+			set_obj_region(copy, to, toSlot);
+			copy_object(copy, object, object_size(object));
+			from->forwards[slot] = copy;
+			(*moved)++;
+		}
+	}
+
+	//Regions kept are put back emptiest first, allocation fills the head
+	vm.regions[sizeClass] = NULL;
+	for (int i = count - 1; i >= 0; i--) {
+		if (regions[i]->forwards != NULL) {
+			regions[i]->next = evacuated;
+			evacuated = regions[i];
+			continue;
+		}
+		regions[i]->next = vm.regions[sizeClass];
+		vm.regions[sizeClass] = regions[i];
+	}
+	free(regions);
+	return evacuated;
+}
+
+static void forward_regions(Region** lists) {
+	for (int i = 0; i < REGION_CLASSES; i++) {
+		for (Region* region = lists[i]; region != NULL; region = region->next) {
+			for (int slot = 0; slot < REGION_OBJECTS; slot++) {
+				if (region->live[slot / 32] & ((uint32_t)1 << (slot % 32)))
+					forward_references(region_object(region, slot));
+			}
+		}
+	}
+}
+
+//Free mostly empty regions by moving their objects, the last sweep found enough free slots for it
+//Runs right after a minor collection so there is nothing in the nursery or the remembered set to fix up
+//Natives return before the next safepoint, so no raw object address outlives a move besides the roots fixed up here
+static void compact_heap(void) {
+	//Swept objects are either dead or unmarked again, moving doesn't have to care about marks
+	finish_sweeping();
+	vm.compactPending = false;
+#ifdef DEBUG_LOG_GC
+	printf("-- compact begin\n");
+#endif
+
+	Region* evacuated = NULL;
+	int moved = 0;
+	for (int i = 1; i < REGION_CLASSES; i++) {
+		evacuated = evacuate_class(i, evacuated, &moved);
+	}
+
+	//Same references a minor collection forwards, only from every old object instead of the remembered ones
+	compacting = true;
+	forward_roots();
+	forward_table(&vm.strings);
+	forward_regions(vm.regions);
+	forward_regions(vm.fullRegions);
+#ifdef GC_PRETENURE
+	//Never evacuated, but what they point at may have moved
+	forward_regions(vm.tenuredRegions);
+	forward_regions(vm.tenuredFullRegions);
+#endif
+	compacting = false;
+
+	//What the objects owned went along with them, only the regions themselves are left to free
+	int freed = 0;
+	while (evacuated != NULL) {
+		Region* region = evacuated;
+		evacuated = region->next;
+		free(region->forwards);
+		heap_free(region, region_size(region->cellSize));
+		freed++;
+	}
+
+#ifdef DEBUG_LOG_GC
+	printf("-- compact end moved %d objects and freed %d regions\n", moved, freed);
+#endif
+}
+#endif
+
+//SAFEPOINT() in run() ends up here once the nursery passed it's limit
+//Incremental collector sets the limit to NULL to get here when a cycle waits to start, so does a pending compaction or running out of memory
+//False if the heap is still over it's limit, run() stops the program then
+bool gc_safepoint(void) {
+	minor_collection();
+	//Promoted objects grow the old generation without going through before_growing(), check the heap for them here
+	if (vm.bytesAllocated > vm.nextGC)
+		collect_garbage();
+	if (over_limit())
+		vm.outOfMemory = true;
+	if (vm.outOfMemory) {
+		//Last try before giving up, incremental cycles can only start here
+		collect_everything();
+#ifdef GC_INCREMENTAL
+		begin_marking();
+		finish_cycle();
+#endif
+		if (over_limit())
+			return false;
+		vm.outOfMemory = false;
+	}
+#ifdef GC_COMPACT
+#ifdef GC_INCREMENTAL
+	//Marking would have to move it's bits and gray objects along, wait for the cycle to end
+	if (vm.compactPending && (vm.gcPhase == GC_IDLE || vm.gcPhase == GC_START))
+#else
+	if (vm.compactPending)
+#endif
+		compact_heap();
+#endif
+#ifdef GC_INCREMENTAL
+	if (vm.gcPhase == GC_START)
+		begin_marking();
+#endif
+	return true;
+}
+#endif
+
+#ifdef GC_CONCURRENT
+//Hand what the VM marked to the marker thread
+static void publish_grays(void) {
+	if (vm.grayCount == 0)
+		return;
+
+	mutex_lock(vm.gcLock);
+	for (int i = 0; i < vm.grayCount; i++) {
+		grow_gray(&vm.sharedGray);
+		vm.sharedGray.objects[vm.sharedGray.count++] = vm.grayStack[i];
+	}
+	vm.grayCount = 0;
+	if (vm.markerIdle)
+		cond_signal(vm.gcWork);
+	mutex_unlock(vm.gcLock);
+}
+
+//Either thread can trace an object, the one that claims it does
+static void marker_blacken(Obj* object) {
+	//Write barrier got to it first
+	if (is_black(object) || !bits_claim(REGION_WORD(claims, object), REGION_BIT(object)))
+		return;
+	blacken_object(object);
+	bits_claim(REGION_WORD(blacks, object), REGION_BIT(object));
+}
+
+//Marker thread takes whatever the VM shared, traces it and everything only reachable through it, then waits for more
+//It never sees the nursery or anything allocated during the cycle, the objects it reads only change after the write barrier blackened them
+static void marker_main(void* arg) {
+	onMarker = true;
+	mutex_lock(vm.gcLock);
+	while (!vm.markerStop) {
+		if (vm.sharedGray.count == 0) {
+			vm.markerIdle = true;
+			cond_wait(vm.gcWork, vm.gcLock);
+			continue;
+		}
+		vm.markerIdle = false;
+
+		//Own stack is empty, trade it for the shared one
+		GrayStack taken = vm.sharedGray;
+		vm.sharedGray = vm.markerGray;
+		vm.markerGray = taken;
+		mutex_unlock(vm.gcLock);
+
+		while (vm.markerGray.count > 0 && !flag_load(&vm.markerStop)) {
+			marker_blacken(vm.markerGray.objects[--vm.markerGray.count]);
+		}
+		mutex_lock(vm.gcLock);
+	}
+	mutex_unlock(vm.gcLock);
+}
+
+//Nothing gray is left anywhere, the VM publishes everything it marks right away
+static bool marker_done(void) {
+	mutex_lock(vm.gcLock);
+	bool done = vm.markerIdle && vm.sharedGray.count == 0;
+	mutex_unlock(vm.gcLock);
+	return done;
+}
+
+void init_concurrent(void) {
+	vm.markerGray = (GrayStack){ 0, 0, NULL };
+	vm.sharedGray = (GrayStack){ 0, 0, NULL };
+	vm.gcLock = new_mutex();
+	vm.gcWork = new_cond_var();
+	vm.markerIdle = true;
+	vm.markerStop = false;
+	vm.marker = thread_start(marker_main, NULL);
+}
+
+static void stop_marker(void) {
+	mutex_lock(vm.gcLock);
+	flag_store(&vm.markerStop, true);
+	cond_signal(vm.gcWork);
+	mutex_unlock(vm.gcLock);
+	thread_join(vm.marker);
+
+	free_cond_var(vm.gcWork);
+	free_mutex(vm.gcLock);
+	free(vm.markerGray.objects);
+	free(vm.sharedGray.objects);
+}
+#endif
+
+#ifdef GC_INCREMENTAL
+static void begin_marking(void) {
+#ifdef DEBUG_LOG_GC
+	printf("-- gc begin marking\n");
+#endif
+	vm.gcPhase = GC_MARKING;
+	//Snapshot at the beginning: what is reachable now gets marked, the write barrier keeps later writes from hiding any of it
+	mark_roots();
+#ifdef GC_CONCURRENT
+	publish_grays();
+#endif
+}
+
+//Only allocations call collect_garbage(), clock is not worth reading more often than that
+static uint64_t now_us(void) {
+	struct timespec time;
+	timespec_get(&time, TIME_UTC);
+	return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+//Objects between looks at the clock
+#define GC_STEP_BATCH 64
+
+static bool out_of_budget(uint64_t start) {
+#ifdef DEBUG_STRESS_GC
+	//Smallest steps possible so cycles stay in progress while the program runs
+	return true;
+#else
+	return now_us() - start >= (uint64_t)vm.gcOptions.pauseBudget;
+#endif
+}
+
+static void finish_marking(void) {
+	table_remove_white(&vm.strings);
+#ifdef GC_GENERATIONAL
+	forget_white();
+#endif
+	start_sweeping();
+	vm.gcPhase = GC_SWEEPING;
+#ifdef DEBUG_LOG_GC
+	printf("-- gc begin sweeping\n");
+#endif
+	if (vm.sweepRegions == NULL)
+		sweep_done();
+}
+
+static void mark_step(uint64_t start) {
+#ifdef GC_CONCURRENT
+	//Marker thread does the tracing, the VM only finishes up once it's done
+	//Roots were marked at the start and are not looked at again, this pause is just the strings table and handing over to the sweeper
+	if (marker_done())
+		finish_marking();
+#else
+	do {
+		for (int i = 0; i < GC_STEP_BATCH && vm.grayCount > 0; i++) {
+			Obj* object = vm.grayStack[--vm.grayCount];
+			//Write barrier got to it first
+			if (is_black(object))
+				continue;
+			blacken_object(object);
+			*REGION_WORD(blacks, object) |= REGION_BIT(object);
+		}
+	} while (vm.grayCount > 0 && !out_of_budget(start));
+
+	if (vm.grayCount == 0)
+		finish_marking();
+#endif
+}
+
+//Allocator may have swept the last region already
+static void sweep_step(uint64_t start) {
+	while (vm.sweepRegions != NULL) {
+		sweep_region();
+		if (out_of_budget(start))
+			break;
+	}
+}
+
+//Run the rest of the cycle without caring about the pause
+static void finish_cycle(void) {
+	while (vm.gcPhase == GC_MARKING) {
+#ifdef GC_CONCURRENT
+		//Marker thread is doing the work
+		thread_yield();
+#endif
+		mark_step(now_us());
+	}
+	finish_sweeping();
+}
+
+void init_incremental(void) {
+	vm.gcPhase = GC_IDLE;
+}
+
+//Owner is about to lose references it had when marking started
+//Trace them now instead of when the owner comes off the gray stack
+void blacken_before_write(Obj* owner) {
+#ifdef GC_CONCURRENT
+	//Marker thread is reading it right now, let it finish before changing anything
+	if (!bits_claim(REGION_WORD(claims, owner), REGION_BIT(owner))) {
+		while (!is_black(owner))
+			thread_yield();
+		return;
+	}
+	set_mark(owner);
+	blacken_object(owner);
+	bits_claim(REGION_WORD(blacks, owner), REGION_BIT(owner));
+	publish_grays();
+#else
+	set_mark(owner);
+	blacken_object(owner);
+	*REGION_WORD(blacks, owner) |= REGION_BIT(owner);
+#endif
+}
+
+//Called whenever allocating passed vm.nextGC: start a cycle or do the next step of the running one
+void collect_garbage(void) {
+	uint64_t start = now_us();
+
+	switch (vm.gcPhase) {
+		case GC_IDLE:
+#ifdef GC_GENERATIONAL
+			//Objects don't move while marking as long as it starts with an empty nursery
+			vm.gcPhase = GC_START;
+			vm.nurseryLimit = NULL;
+#else
+			begin_marking();
+#endif
+			break;
+
+		//Safepoint is coming
+		case GC_START:
+			break;
+
+		case GC_MARKING:
+			mark_step(start);
+			break;
+
+		case GC_SWEEPING:
+			sweep_step(start);
+			break;
+	}
+
+	if (vm.gcPhase != GC_IDLE)
+		vm.nextGC = vm.bytesAllocated + GC_STEP_BYTES;
+}
+#else
+void collect_garbage(void) {
+	//Marks of the last collection have to be gone before marking starts over
+	finish_sweeping();
+#ifdef DEBUG_LOG_GC
+	printf("-- gc begin\n");
+#endif
+
+	mark_roots();
+	trace_references();
+	table_remove_white(&vm.strings);
+#ifdef GC_GENERATIONAL
+	forget_white();
+#endif
+	//Sweeping is left to the allocator, it takes a region at a time when it needs room
+	start_sweeping();
+#ifdef GC_GENERATIONAL
+	//Nursery is not swept, minor collections take care of it's garbage
+	memset(vm.nurseryMarks, 0, NURSERY_SIZE / 8 / 8);
+#endif
+	//Nothing is freed yet, sweep_done() lowers it to what survived once the last region is swept
+	vm.nextGC = next_threshold(vm.bytesAllocated);
+	if (vm.sweepRegions == NULL)
+		sweep_done();
+
+#ifdef DEBUG_LOG_GC
+	printf("-- gc end marking at %zu\n", vm.bytesAllocated);
+#endif
+}
+#endif
+
+//Free as much as possible right now, the heap is over it's limit or the system is out of memory
+static void collect_everything(void) {
+#ifdef GC_INCREMENTAL
+	//Running cycle only frees what was garbage when it started, a whole new one gets the rest
+	finish_cycle();
+#ifndef GC_GENERATIONAL
+	begin_marking();
+	finish_cycle();
+#endif
+#else
+	collect_garbage();
+	finish_sweeping();
+#endif
+}
+
+void default_gc_options(GcOptions* options) {
+	options->minHeap = GC_MIN_HEAP;
+	options->heapGrowth = GC_HEAP_GROWTH;
+	options->heapLimit = 0;
+	options->pauseBudget = GC_PAUSE_BUDGET_US;
+	options->markThreads = GC_MARK_THREADS;
+}
+
+void free_objects(void) {
+#ifdef GC_CONCURRENT
+	stop_marker();
+#endif
+#ifdef GC_PARALLEL
+	stop_helpers();
+#endif
+	start_sweeping();
+	for (Region* region = vm.sweepRegions; region != NULL; ) {
+		Region* trash = region;
+		region = region->next;
+		for (int slot = 0; slot < REGION_OBJECTS; slot++) {
+			if (trash->live[slot / 32] & ((uint32_t)1 << (slot % 32)))
+				free_slot(trash, slot);
+		}
+		heap_free(trash, region_size(trash->cellSize));
+	}
+
+#ifdef GC_GENERATIONAL
+	for (Obj* object = (Obj*)vm.nursery; (char*)object < vm.nurseryTop; object = next_young(object)) {
+		free_object_data(object);
+	}
+	heap_free(vm.nursery, NURSERY_SIZE);
+	free(vm.nurseryMarks);
+	free(vm.remembered);
+#endif
+#ifdef GC_PRETENURE
+	free(vm.sites);
+	free(vm.youngSites);
+#endif
+
+	free(vm.grayStack);
+#ifdef GC_COMPRESSED_REFS
+	release_heap();
+#endif
 }
\ No newline at end of file
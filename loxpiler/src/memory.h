@@ -1,7 +1,9 @@
 ﻿#pragma once
 
 #include "common.h"
+#include "object.h"
 #include "value.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count) \
     (type*)reallocate(NULL, 0, sizeof(type) * (count))
@@ -18,6 +20,109 @@
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+//Most objects a region tracks, the slot in a region has to fit Obj.slot
+#define REGION_OBJECTS 256
+#define REGION_WORDS (REGION_OBJECTS / 32)
+
+//Old objects live in regions, the collector keeps it's bits for them in bitmaps there instead of in the objects
+//Marking doesn't write to the objects and clearing the bits is a memset
+//Small objects are stored in the region itself, every region has a single size class so a free slot fits any object of the class
+//Large ones get allocated on their own and the region only points at them
+struct Region {
+	struct Region* next;
+	//Slots holding an object
+	uint32_t live[REGION_WORDS];
+	//Reachable, cleared once the region is swept
+	uint32_t marks[REGION_WORDS];
+#ifdef GC_INCREMENTAL
+	//Marked and it's references traced, incremental marking needs to tell it apart from marked but still gray
+	uint32_t blacks[REGION_WORDS];
+	//Concurrent marking: set by whichever thread, VM or marker, gets to trace the object's references
+	uint32_t claims[REGION_WORDS];
+#endif
+#ifdef GC_GENERATIONAL
+	//In the remembered set, it may point at young objects
+	//Not a header bit, the VM sets it while a concurrent marker reads the header
+	uint32_t remembered[REGION_WORDS];
+#endif
+	int liveCount;
+	//Bytes per slot, 0 if the slots hold pointers to large objects
+	int cellSize;
+#ifdef GC_PRETENURE
+	//Holds pretenured objects, it goes back on vm.tenuredRegions after it's swept
+	bool tenured;
+#endif
+#ifdef GC_COMPACT
+	//Set while compaction moves the objects out, new address of the object in each slot
+	Obj** forwards;
+#endif
+	//Objects of the size class one after the other or the pointers, uint64_t keeps them aligned for a Value
+	uint64_t cells[];
+};
+
+//Bit of an old object in one of it's region's bitmaps
+#define REGION_WORD(bitmap, object) (&obj_region(object)->bitmap[obj_slot(object) / 32])
+#define REGION_BIT(object) ((uint32_t)1 << (obj_slot(object) % 32))
+
+#ifdef GC_COMPRESSED_REFS
+//Address space reserved for the heap, an offset anywhere in it fits in a Ref
+#define HEAP_RESERVE ((size_t)1 << 32)
+//Reserved memory is committed this much at a time as the heap grows into it
+#define HEAP_COMMIT_STEP (1024 * 1024)
+//Heap is out of memory once less than this is left of the reserve, the program can still allocate until the next safepoint stops it
+#define HEAP_RESERVE_SLACK (16 * 1024 * 1024)
+
+void init_heap(void);
+
+static inline Ref to_ref(void* object) {
+	return object == NULL ? 0 : (Ref)((char*)object - vm.heap);
+}
+
+//Nothing is ever allocated at offset 0
+static inline void* from_ref(Ref ref) {
+	return ref == 0 ? NULL : vm.heap + ref;
+}
+#endif
+
+//References stored as a Ref when GC_COMPRESSED_REFS is on
+static inline ObjString* entry_key(Entry* entry) {
+#ifdef GC_COMPRESSED_REFS
+	return (ObjString*)from_ref(entry->key);
+#else
+	return entry->key;
+#endif
+}
+
+static inline void set_entry_key(Entry* entry, ObjString* key) {
+#ifdef GC_COMPRESSED_REFS
+	entry->key = to_ref(key);
+#else
+	entry->key = key;
+#endif
+}
+
+static inline ObjFunction* closure_function(ObjClosure* closure) {
+#ifdef GC_COMPRESSED_REFS
+	return (ObjFunction*)from_ref(closure->function);
+#else
+	return closure->function;
+#endif
+}
+
+static inline void set_closure_function(ObjClosure* closure, ObjFunction* function) {
+#ifdef GC_COMPRESSED_REFS
+	closure->function = to_ref(function);
+#else
+	closure->function = function;
+#endif
+}
+
+//Defaults for GcOptions
+#define GC_MIN_HEAP (1024 * 1024)
+#define GC_HEAP_GROWTH 2
+#define GC_PAUSE_BUDGET_US 500
+#define GC_MARK_THREADS 0
+
 //Size args control which operation to perform
 //oldSize 		newSize 					Operation
 //---------------------------------------------------------
@@ -29,4 +134,123 @@ void* reallocate(void* ptr, size_t oldCap, size_t newCap);
 void mark_object(Obj* object);
 void mark_value(Value value);
 void collect_garbage(void);
-void free_objects(void);
\ No newline at end of file
+Obj* allocate_old(size_t size);
+bool is_marked(Obj* object);
+void free_objects(void);
+void default_gc_options(GcOptions* options);
+
+#ifdef GC_PARALLEL
+//Most gray objects one steal takes
+#define GC_STEAL_MAX 256
+
+void init_parallel(void);
+#endif
+
+#ifdef GC_INCREMENTAL
+//Allocated bytes between 2 steps of a running cycle
+#define GC_STEP_BYTES (64 * 1024)
+
+void init_incremental(void);
+void blacken_before_write(Obj* owner);
+#ifdef GC_CONCURRENT
+void init_concurrent(void);
+#endif
+
+//Objects allocated while marking survive the cycle, the marker is not going to look at them
+static inline bool allocate_black(void) {
+	return vm.gcPhase == GC_MARKING;
+}
+#endif
+
+#ifdef GC_GENERATIONAL
+//Bump allocated space new objects start out in
+#define NURSERY_SIZE (256 * 1024)
+//Minor collection at the first safepoint after less than this much of the nursery is left
+//The rest is for what gets allocated before the VM reaches a safepoint
+#define NURSERY_RESERVE (NURSERY_SIZE / 4)
+//Keep every object in the nursery 8 byte aligned
+#define NURSERY_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+void init_nursery(void);
+Obj* allocate_young(size_t size);
+void remember_object(Obj* object);
+bool gc_safepoint(void);
+
+static inline bool is_young(Obj* object) {
+	return (uintptr_t)object - (uintptr_t)vm.nursery < NURSERY_SIZE;
+}
+
+//Only old objects are ever remembered
+static inline bool is_remembered(Obj* object) {
+	return (*REGION_WORD(remembered, object) & REGION_BIT(object)) != 0;
+}
+#endif
+
+#ifdef GC_PRETENURE
+//Young objects of a site looked at before deciding again if it's tenured
+#define PRETENURE_SAMPLE 256
+//Percent of them that have to survive their first minor collection
+#define PRETENURE_SURVIVAL 80
+//1 object in this many of a tenured site still starts out young so the site keeps getting sampled
+#define PRETENURE_RESAMPLE 16
+
+int new_alloc_site(void);
+bool pretenure_site(int site);
+void track_young_site(Obj* object, int site);
+Obj* allocate_tenured(size_t size);
+
+//Next object allocated is for this site, a cache without a site yet gets one
+static inline void use_alloc_site(int* site) {
+	if (*site == 0)
+		*site = new_alloc_site();
+	vm.allocSite = *site;
+}
+#endif
+
+#ifdef GC_COMPACT
+//Free slots of a size class, counted in regions, before compaction bothers
+#define COMPACT_MIN_REGIONS 4
+#endif
+
+#ifdef GC_INCREMENTAL
+//References traced, the write barrier can leave it alone
+static inline bool is_black(Obj* object) {
+#ifdef GC_GENERATIONAL
+	//Marking started with an empty nursery, anything in it got allocated during the cycle
+	if (is_young(object))
+		return true;
+#endif
+#ifdef GC_CONCURRENT
+	//Marker thread sets it once it's done reading the object
+	return (bits_load(REGION_WORD(blacks, object)) & REGION_BIT(object)) != 0;
+#else
+	return (*REGION_WORD(blacks, object) & REGION_BIT(object)) != 0;
+#endif
+}
+#endif
+
+//Call before storing a reference into a heap object
+//Incremental marking traces what the owner pointed at when marking started before the write can drop it
+//Old object pointing at a young one goes into the remembered set, minor collections only see the nursery and the roots otherwise
+static inline void write_barrier(Obj* owner, Value value) {
+#ifdef GC_INCREMENTAL
+	if (vm.gcPhase == GC_MARKING && !is_black(owner))
+		blacken_before_write(owner);
+#endif
+#ifdef GC_GENERATIONAL
+	if (IS_OBJ(value) && is_young(AS_OBJ(value)) && !is_young(owner) && !is_remembered(owner))
+		remember_object(owner);
+#endif
+}
+
+//Copying a whole bunch of references, remember the owner without looking at them
+static inline void write_barrier_bulk(Obj* owner) {
+#ifdef GC_INCREMENTAL
+	if (vm.gcPhase == GC_MARKING && !is_black(owner))
+		blacken_before_write(owner);
+#endif
+#ifdef GC_GENERATIONAL
+	if (!is_young(owner) && !is_remembered(owner))
+		remember_object(owner);
+#endif
+}
\ No newline at end of file
@@ -10,13 +10,49 @@ static void print_function(ObjFunction* function);
 #define ALLOCATE_OBJ(type, objectType) \
     (type*)allocate_object(sizeof(type), objectType)
 
+//Object ending in a flexible array member of count items
+#define ALLOCATE_FLEX_OBJ(type, itemType, count, objectType) \
+    (type*)allocate_object(sizeof(type) + sizeof(itemType) * (count), objectType)
+
 static Obj* allocate_object(size_t size, ObjType type) {
-	Obj* object = (Obj*)reallocate(NULL, 0, size);
-	object->type = type;
-	object->isMarked = false;
-	//Insert at head of GC linked list
-	object->next = vm.objects;
-	vm.objects = object;
+#ifdef GC_GENERATIONAL
+#ifdef GC_PRETENURE
+	//Site the VM is allocating for, objects of one that mostly survives skip the nursery
+	int site = vm.allocSite;
+	vm.allocSite = 0;
+	bool tenured = pretenure_site(site);
+	Obj* object = tenured ? NULL : allocate_young(size);
+#else
+	Obj* object = allocate_young(size);
+#endif
+	if (object != NULL) {
+		//Not tracked by the collector, forwarding stays NULL until it gets promoted
+		object->header = 0;
+		set_obj_type(object, type);
+#ifdef GC_PRETENURE
+		if (site != 0)
+			track_young_site(object, site);
+#endif
+	}
+	else {
+		//Nursery is full, the next safepoint empties it, or the object is pretenured
+#ifdef GC_PRETENURE
+		object = tenured ? allocate_tenured(size) : allocate_old(size);
+#else
+		object = allocate_old(size);
+#endif
+		set_obj_type(object, type);
+		//Old from the start, the constructor fills it in without write barriers so remember it
+		//Objects with a site get barriers instead, the next minor collection would scan every pretenured object otherwise
+#ifdef GC_PRETENURE
+		if (!tenured)
+#endif
+			remember_object(object);
+	}
+#else
+	Obj* object = allocate_old(size);
+	set_obj_type(object, type);
+#endif
 
 #ifdef DEBUG_LOG_GC
 	printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -28,6 +64,13 @@ ObjClass* new_class(ObjString* name) {
 	//Klass so it is easy to compile for c++ where class is keyword
 	ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
 	klass->name = name;
+#ifdef GC_PRETENURE
+	write_barrier((Obj*)klass, OBJ_VAL(name));
+#endif
+	klass->vtable = NULL;
+	klass->vtableSize = 0;
+	klass->initializer = NULL;
+	klass->fieldCount = 0;
 	init_table(&klass->methods);
 	return klass;
 }
@@ -35,7 +78,17 @@ ObjClass* new_class(ObjString* name) {
 ObjInstance* new_instance(ObjClass* klass) {
 	ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
 	instance->klass = klass;
+#ifdef GC_PRETENURE
+	write_barrier((Obj*)instance, OBJ_VAL(klass));
+#endif
 	init_table(&instance->fields);
+
+	//Instances of a class mostly get the same fields, size the table for them so setting them does not rehash
+	if (klass->fieldCount > 0) {
+		push_stack(OBJ_VAL(instance));
+		table_reserve(&instance->fields, klass->fieldCount);
+		pop_stack();
+	}
 	return instance;
 }
 
@@ -50,6 +103,10 @@ ObjFunction* new_function(void) {
 	ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
 	function->arity = 0;
 	function->upvalueCount = 0;
+	function->maxStack = 0;
+	function->closure = NULL;
+	function->callCaches = NULL;
+	function->callCacheCount = 0;
 	function->name = NULL;
 	init_chunk(&function->chunk);
 	return function;
@@ -57,15 +114,16 @@ ObjFunction* new_function(void) {
 
 ObjClosure* new_closure(ObjFunction* function) {
 
-	ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+	ObjClosure* closure = ALLOCATE_FLEX_OBJ(ObjClosure, Value, function->upvalueCount, OBJ_CLOSURE);
+	set_closure_function(closure, function);
+#ifdef GC_PRETENURE
+	//VM stores the upvalues with barriers for a pretenured closure
+	write_barrier((Obj*)closure, OBJ_VAL(function));
+#endif
+	closure->upvalueCount = function->upvalueCount;
 	for (int i = 0; i < function->upvalueCount; i++) {
-		upvalues[i] = NULL;
+		closure->upvalues[i] = NIL_VAL;
 	}
-
-	ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-	closure->function = function;
-	closure->upvalues = upvalues;
-	closure->upvalueCount = function->upvalueCount;
 	return closure;
 }
 
@@ -80,6 +138,7 @@ static ObjString* allocate_string(char* chars, int length, uint32_t hash) {
 	string->length = length;
 	string->chars = chars;
 	string->hash = hash;
+	string->selector = -1;
 
 	push_stack(OBJ_VAL(string));
 	//Store string in interned strings table (more like a hashset)
@@ -90,7 +149,7 @@ static ObjString* allocate_string(char* chars, int length, uint32_t hash) {
 }
 
 //FNV-1a hash
-static uint32_t hash_string(const char* key, int length) {
+uint32_t hash_string(const char* key, int length) {
 	uint32_t hash = 2166136261u;
 	for (int i = 0; i < length; i++) {
 		hash ^= (uint8_t)key[i];
@@ -112,7 +171,7 @@ void print_object(Value value) {
 			break;
 
 		case OBJ_BOUND_METHOD:
-			print_function(AS_BOUND_METHOD(value)->method->function);
+			print_function(closure_function(AS_BOUND_METHOD(value)->method));
 			break;
 
 		case OBJ_FUNCTION:
@@ -120,7 +179,7 @@ void print_object(Value value) {
 			break;
 
 		case OBJ_CLOSURE:
-			print_function(AS_CLOSURE(value)->function);
+			print_function(closure_function(AS_CLOSURE(value)));
 			break;
 
 		case OBJ_STRING:
@@ -137,6 +196,15 @@ void print_object(Value value) {
 	}
 }
 
+//Interned strings are weak, one that nothing pointed at when marking started is about to be used again
+static ObjString* revive_string(ObjString* string) {
+#ifdef GC_INCREMENTAL
+	if (vm.gcPhase == GC_MARKING)
+		mark_object((Obj*)string);
+#endif
+	return string;
+}
+
 ObjString* take_string(char* chars, int length) {
 	uint32_t hash = hash_string(chars, length);
 	//Look if string already exists in interned strings table
@@ -146,7 +214,7 @@ ObjString* take_string(char* chars, int length) {
 		//Need to free memory of passed in string
 		//Ownership is being passed to this func
 		FREE_ARRAY(char, chars, length + 1);
-		return interned;
+		return revive_string(interned);
 	}
 	return allocate_string(chars, length, hash);
 }
@@ -157,7 +225,7 @@ ObjString* copy_string(const char* chars, int length) {
 	//if it does, just return that string instead of allocating a new one
 	ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
 	if (interned != NULL)
-		return interned;
+		return revive_string(interned);
 
 	char* heapChars = ALLOCATE(char, length + 1);
 	memcpy(heapChars, chars, length);
@@ -169,10 +237,72 @@ ObjUpvalue* new_upvalue(Value* slot) {
 	ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
 	upvalue->closed = NIL_VAL;
 	upvalue->location = slot;
-	upvalue->next = NULL;
 	return upvalue;
 }
 
+//Bytes allocated for the object itself, not what it owns
+size_t object_size(Obj* object) {
+	switch (obj_type(object)) {
+		case OBJ_FUNCTION:     return sizeof(ObjFunction);
+		case OBJ_CLOSURE:      return sizeof(ObjClosure) + sizeof(Value) * ((ObjClosure*)object)->upvalueCount;
+		case OBJ_CLASS:        return sizeof(ObjClass);
+		case OBJ_INSTANCE:     return sizeof(ObjInstance);
+		case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+		case OBJ_NATIVE:       return sizeof(ObjNative);
+		case OBJ_STRING:       return sizeof(ObjString);
+		case OBJ_UPVALUE:      return sizeof(ObjUpvalue);
+	}
+	return 0;
+}
+
+//Strings are interned so the id stored on the string is the same for every use of the name
+//A name only loses it's id when the string gets collected, by then no class has a method with that name
+int selector_id(ObjString* name) {
+	if (name->selector == -1)
+		name->selector = vm.selectorCount++;
+	return name->selector;
+}
+
+//Class and method have to be reachable by the GC, growing the vtable allocates
+void set_vtable_method(ObjClass* klass, ObjString* name, ObjClosure* method) {
+	int selector = selector_id(name);
+	if (selector < klass->vtableSize) {
+		klass->vtable[selector] = method;
+		return;
+	}
+
+	//Leave far away selectors to the methods table instead of growing a mostly empty vtable
+	int size = selector + 1;
+	if (size > VTABLE_DENSE_MIN && size > klass->methods.size * VTABLE_SPARSENESS)
+		return;
+
+	klass->vtable = GROW_ARRAY(ObjClosure*, klass->vtable, klass->vtableSize, size);
+	for (int i = klass->vtableSize; i < size; i++) {
+		klass->vtable[i] = NULL;
+	}
+	klass->vtableSize = size;
+
+	//Methods skipped earlier for being too far out may be covered now
+	for (int i = 0; i < klass->methods.cap; i++) {
+		Entry* entry = &klass->methods.elements[i];
+		ObjString* name = entry_key(entry);
+		if (name != NULL && name->selector >= 0 && name->selector < size)
+			klass->vtable[name->selector] = AS_CLOSURE(entry->value);
+	}
+}
+
+//Subclass has no methods of it's own yet, start from a copy of the superclass vtable
+void inherit_vtable(ObjClass* subclass, ObjClass* superclass) {
+	if (superclass->vtableSize == 0)
+		return;
+
+	ObjClosure** vtable = ALLOCATE(ObjClosure*, superclass->vtableSize);
+	memcpy(vtable, superclass->vtable, sizeof(ObjClosure*) * superclass->vtableSize);
+	FREE_ARRAY(ObjClosure*, subclass->vtable, subclass->vtableSize);
+	subclass->vtable = vtable;
+	subclass->vtableSize = superclass->vtableSize;
+}
+
 static void print_function(ObjFunction* function) {
 	if (function->name == NULL) {
 		printf("<script>");
@@ -5,7 +5,7 @@
 #include "table.h"
 #include "value.h"
 
-#define OBJ_TYPE(value)        (AS_OBJ(value)->type)
+#define OBJ_TYPE(value)        (obj_type(AS_OBJ(value)))
 #define IS_FUNCTION(value)     is_obj_type(value, OBJ_FUNCTION)
 #define IS_CLOSURE(value)      is_obj_type(value, OBJ_CLOSURE)
 #define IS_CLASS(value)        is_obj_type(value, OBJ_CLASS)
@@ -19,6 +19,7 @@
 #define AS_CLASS(value)        ((ObjClass*)AS_OBJ(value))
 #define AS_INSTANCE(value)     ((ObjInstance*)AS_OBJ(value))
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_UPVALUE(value)      ((ObjUpvalue*)AS_OBJ(value))
 #define AS_NATIVE(value) \
     (((ObjNative*)AS_OBJ(value))->function)
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
@@ -35,20 +36,66 @@ typedef enum {
 	OBJ_UPVALUE,
 } ObjType;
 
+//Header is a single word, read and written through the functions below
+//Low 48 bits: young object that got promoted: address of it's copy in the old generation
+//             old object: region tracking it, that's where it's bits are
+//Pointers fit in 48 bits on x64, NaN boxing relies on that too
+//Next 8 bits: old object's index in it's region
+//Top 8 bits: type
+//Mark bits and the remembered bit are not in here but in bitmaps beside the objects, see is_marked()
 struct Obj {
-	ObjType type;
-	//For GC
-	//Mark flag (reachability)
-	bool isMarked;
-	//Linked list of all heap allocated objects
-	struct Obj* next;
+	uint64_t header;
 };
 
+#define HEADER_POINTER_MASK (((uint64_t)1 << 48) - 1)
+#define HEADER_SLOT_SHIFT 48
+#define HEADER_TYPE_SHIFT 56
+
+static inline ObjType obj_type(Obj* object) {
+	return (ObjType)(object->header >> HEADER_TYPE_SHIFT);
+}
+
+static inline void set_obj_type(Obj* object, ObjType type) {
+	object->header = (object->header & ~((uint64_t)0xff << HEADER_TYPE_SHIFT)) | (uint64_t)type << HEADER_TYPE_SHIFT;
+}
+
+static inline struct Region* obj_region(Obj* object) {
+	return (struct Region*)(uintptr_t)(object->header & HEADER_POINTER_MASK);
+}
+
+static inline int obj_slot(Obj* object) {
+	return (int)((object->header >> HEADER_SLOT_SHIFT) & 0xff);
+}
+
+//Type stays what it was
+static inline void set_obj_region(Obj* object, struct Region* region, int slot) {
+	object->header = (object->header & ((uint64_t)0xff << HEADER_TYPE_SHIFT))
+		| (uint64_t)slot << HEADER_SLOT_SHIFT | (uint64_t)(uintptr_t)region;
+}
+
+static inline Obj* obj_forwarding(Obj* object) {
+	return (Obj*)(uintptr_t)(object->header & HEADER_POINTER_MASK);
+}
+
+static inline void set_obj_forwarding(Obj* object, Obj* copy) {
+	object->header = (object->header & ((uint64_t)0xff << HEADER_TYPE_SHIFT)) | (uint64_t)(uintptr_t)copy;
+}
+
+typedef struct CallCache CallCache;
+
 typedef struct {
 	Obj obj;
 	//number of parameters
 	int arity;
 	int upvalueCount;
+	//Most stack slots the function uses at once, slot 0 + locals + temporaries
+	int maxStack;
+	//Closure shared by every OP_CLOSURE of a function without upvalues, NULL until first created
+	struct ObjClosure* closure;
+	//1 cache per OP_CALL in the chunk, operand of the instruction is the index
+	//GC_PRETENURE gives OP_CLOSURE and OP_CLASS one too
+	CallCache* callCaches;
+	int callCacheCount;
 	Chunk chunk;
 	ObjString* name;
 } ObjFunction;
@@ -58,20 +105,43 @@ typedef struct ObjUpvalue {
 	Obj obj;
 	Value* location;
 	Value closed;
-	struct ObjUpvalue* next;
 } ObjUpvalue;
 
-typedef struct {
+typedef struct ObjClosure {
 	Obj obj;
+	//Read and written through closure_function() and set_closure_function()
+#ifdef GC_COMPRESSED_REFS
+	Ref function;
+#else
 	ObjFunction* function;
-	ObjUpvalue** upvalues;
+#endif
 	int upvalueCount;
+	//Stored inline, a closure is a single allocation
+	//ObjUpvalue for variables shared with the enclosing function, the value itself for variables captured by value
+	Value upvalues[];
 } ObjClosure;
 
+//A vtable always covers this many selectors, beyond that it may only be VTABLE_SPARSENESS times bigger than the number of methods
+//Selectors outside the vtable are looked up in the methods table
+#define VTABLE_DENSE_MIN 32
+#define VTABLE_SPARSENESS 4
+
+//Don't pre-size instances beyond this, one odd instance with lots of fields should not bloat all the others
+#define FIELDS_RESERVE_MAX 64
+
 typedef struct {
 	Obj obj;
 	ObjString* name;
 	Table methods;
+	//Methods indexed by selector id of their name, NULL if the class has no method for that selector
+	//Every method with a selector below vtableSize is in here, others only in methods
+	ObjClosure** vtable;
+	int vtableSize;
+	//init method, NULL if the class has none
+	//Kept in sync with methods by OP_INHERIT and OP_METHOD so instantiating does not need a table lookup
+	ObjClosure* initializer;
+	//Most fields an instance of this class ended up with, new instances get that room right away
+	int fieldCount;
 } ObjClass;
 
 typedef struct {
@@ -97,12 +167,36 @@ typedef struct {
 	NativeFn function;
 } ObjNative;
 
+//Remembers what a call site called last time and how
+//Most call sites always call the same function, if it's the same object again we skip the type switch and arity check
+//Super sites store the superclass as callee and the method they resolved to as closure
+//Index of the cache every site past the 16 bit operand range shares, the VM never fills it
+#define CALL_CACHE_SHARED UINT16_MAX
+
+struct CallCache {
+	//Closure, native or class called last time, NULL if nothing cached yet
+	Obj* callee;
+	//Closure to push a frame for: the callee itself or the initializer of a class
+	ObjClosure* closure;
+	//Set if callee is a class, create an instance first
+	ObjClass* klass;
+	//Set if callee is a native
+	NativeFn native;
+#ifdef GC_PRETENURE
+	//Allocation site of the instances a class callee creates here
+	//OP_CLOSURE and OP_CLASS get a cache of their own just for this, 0 until the first allocation
+	int site;
+#endif
+};
+
 struct ObjString {
 	Obj obj;
 	int length;
 	char* chars;
 	//Calc hash upfront , strings are immutable, and store
 	uint32_t hash;
+	//Global method selector id of this name, -1 until it's used as a method name
+	int selector;
 };
 
 
@@ -115,7 +209,24 @@ ObjClosure* new_closure(ObjFunction* function);
 ObjNative* new_native(NativeFn function);
 ObjString* take_string(char* chars, int length);
 ObjString* copy_string(const char* chars, int length);
+uint32_t hash_string(const char* key, int length);
 ObjUpvalue* new_upvalue(Value* slot);
+size_t object_size(Obj* object);
+int selector_id(ObjString* name);
+void set_vtable_method(ObjClass* klass, ObjString* name, ObjClosure* method);
+void inherit_vtable(ObjClass* subclass, ObjClass* superclass);
+
+//Method lookup, vtable first and methods table for selectors it does not cover
+static inline ObjClosure* find_method(ObjClass* klass, ObjString* name) {
+	int selector = name->selector;
+	if (selector >= 0 && selector < klass->vtableSize)
+		return klass->vtable[selector];
+
+	Value method;
+	if (table_get(&klass->methods, name, &method))
+		return AS_CLOSURE(method);
+	return NULL;
+}
 static inline bool is_obj_type(Value value, ObjType type) {
-	return IS_OBJ(value) && AS_OBJ(value)->type == type;
+	return IS_OBJ(value) && obj_type(AS_OBJ(value)) == type;
 }
\ No newline at end of file
@@ -43,7 +43,8 @@ Entry* find_entry(Entry* entries, int cap, ObjString* key) {
 	Entry* tombstone = NULL;
 	for(;;) {
 		Entry* entry = &entries[index];
-		if(entry->key == NULL) {
+		ObjString* entryKey = entry_key(entry);
+		if(entryKey == NULL) {
 			if (IS_NIL(entry->value)) {
 				
 				//Empty entry
@@ -59,7 +60,7 @@ Entry* find_entry(Entry* entries, int cap, ObjString* key) {
 		//Found key
 		//We can compare pointers because string interning
 		//String compare is slow (loop over every char)
-		else if (entry->key == key)
+		else if (entryKey == key)
 			return entry;
 		
 		//Linear probing to handle collisions
@@ -72,7 +73,7 @@ static void adjust_capacity(Table* table, int cap) {
 	Entry* entries = ALLOCATE(Entry, cap);
 	//Empty buckets
 	for(int i = 0; i < cap; i++) {
-		entries[i].key = NULL;
+		set_entry_key(&entries[i], NULL);
 		entries[i].value = NIL_VAL;
 	}
 
@@ -82,12 +83,13 @@ static void adjust_capacity(Table* table, int cap) {
 	//Rehash elems
 	for(int i = 0; i < table->cap; i++) {
 		Entry* entry = &table->elements[i];
+		ObjString* key = entry_key(entry);
 		
-		if(entry->key == NULL)
+		if(key == NULL)
 			continue;
 
-		Entry* dest = find_entry(entries, cap, entry->key);
-		dest->key = entry->key;
+		Entry* dest = find_entry(entries, cap, key);
+		set_entry_key(dest, key);
 		dest->value = entry->value;
 		table->size++;
 	}
@@ -99,12 +101,22 @@ static void adjust_capacity(Table* table, int cap) {
 	table->cap = cap;
 }
 
+//Grow the table up front so count entries fit without rehashing along the way
+void table_reserve(Table* table, int count) {
+	int capacity = table->cap;
+	while (count > capacity * TABLE_MAX_LOAD) {
+		capacity = GROW_CAPACITY(capacity);
+	}
+	if (capacity > table->cap)
+		adjust_capacity(table, capacity);
+}
+
 //Val output param
 bool table_get(Table* table, ObjString* key, Value* value) {
 	if (table->size == 0)
 		return false;
 	Entry* entry = find_entry(table->elements, table->cap, key);
-	if (entry->key == NULL)
+	if (entry_key(entry) == NULL)
 		return false;
 	*value = entry->value;
 	return true;
@@ -118,14 +130,14 @@ bool table_set(Table* table, ObjString* key, Value value) {
 	}
 
 	Entry* entry = find_entry(table->elements, table->cap, key);
-	bool isNewKey = entry->key == NULL;
+	bool isNewKey = entry_key(entry) == NULL;
 
 	//Only increment count when we insert in a totally empty entry and not a tombstone or new key
 	//Bucket with tombstone has been accounted for
 	if (isNewKey && IS_NIL(entry->value))
 		table->size++;
 
-	entry->key = key;
+	set_entry_key(entry, key);
 	entry->value = value;
 
 	return isNewKey;
@@ -139,19 +151,29 @@ bool table_delete(Table* table, ObjString* key) {
 	//Look for entry
 	Entry* entry = find_entry(table->elements,table->cap, key);
 	//Not in table
-	if (entry->key == NULL)
+	if (entry_key(entry) == NULL)
 		return false;
 	//Delete key from table and set tombstone (val = true)
-	entry->key = NULL;
+	set_entry_key(entry, NULL);
 	entry->value = BOOL_VAL(true);
 	return true;
 }
 
+//Key object moved, same string so the entry stays where it is
+void table_move_key(Table* table, ObjString* from, ObjString* to) {
+	if (table->size == 0)
+		return;
+	Entry* entry = find_entry(table->elements, table->cap, from);
+	if (entry_key(entry) == from)
+		set_entry_key(entry, to);
+}
+
 void table_add_all(Table* from, Table* to) {
 	for(int i = 0; i < from->cap; i++) {
 		Entry* entry = &from->elements[i];
-		if (entry->key != NULL)
-			table_set(to, entry->key, entry->value);
+		ObjString* key = entry_key(entry);
+		if (key != NULL)
+			table_set(to, key, entry->value);
 	}
 }
 
@@ -162,26 +184,36 @@ ObjString* table_find_string(Table* table, const char* chars, int length, uint32
 	uint32_t index = hash & (table->cap - 1);
 	for(;;) {
 		Entry* entry = &table->elements[index];
-		if(entry->key == NULL) {
+		ObjString* key = entry_key(entry);
+		if(key == NULL) {
 			//Stop if non empty, non tombstone entry
 			if (IS_NIL(entry->value)) return NULL;
 
-		} else if(entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0) {
+		} else if(key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0) {
 			//Found it
-			return entry->key;
+			return key;
 		}
 		//index = (index + 1 ) % table->cap;
 		index = (index + 1) & (table->cap - 1);
 	}
 }
 
+//Young strings are left to minor collections
+static bool is_young_key(ObjString* key) {
+#ifdef GC_GENERATIONAL
+	return is_young((Obj*)key);
+#else
+	return false;
+#endif
+}
+
 void table_remove_white(Table* table) {
 	//Clear out dangling pointers for to be freed memory
 	//Remove references to strings that will be swept after this
 	for (int i = 0; i < table->cap; i++) {
-		Entry* entry = &table->elements[i];
-		if (entry->key != NULL && !entry->key->obj.isMarked) {
-			table_delete(table, entry->key);
+		ObjString* key = entry_key(&table->elements[i]);
+		if (key != NULL && !is_young_key(key) && !is_marked((Obj*)key)) {
+			table_delete(table, key);
 		}
 	}
 }
@@ -189,7 +221,7 @@ void table_remove_white(Table* table) {
 void mark_table(Table* table) {
 	for(int i = 0; i < table->cap; i++) {
 		Entry* entry = &table->elements[i];
-		mark_object((Obj*)entry->key);
+		mark_object((Obj*)entry_key(entry));
 		mark_value(entry->value);
 	}
 }
\ No newline at end of file
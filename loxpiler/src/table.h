@@ -3,10 +3,22 @@
 #include "common.h"
 #include "value.h"
 
+#ifdef GC_COMPRESSED_REFS
+//Entry is 12 bytes instead of 16, the value doesn't need more than 4 byte alignment on x64
+#pragma pack(push, 4)
+#endif
+//Key is read and written through entry_key() and set_entry_key()
 typedef struct {
+#ifdef GC_COMPRESSED_REFS
+	Ref key;
+#else
 	ObjString* key;
+#endif
 	Value value;
 } Entry;
+#ifdef GC_COMPRESSED_REFS
+#pragma pack(pop)
+#endif
 
 typedef struct {
 	int size;
@@ -18,7 +30,9 @@ void init_table(Table* table);
 void free_table(Table* table);
 bool table_get(Table* table, ObjString* key, Value* value);
 bool table_set(Table* table, ObjString* key, Value value);
+void table_reserve(Table* table, int count);
 bool table_delete(Table* table, ObjString* key);
+void table_move_key(Table* table, ObjString* from, ObjString* to);
 void table_add_all(Table* from, Table* to);
 ObjString* table_find_string(Table* table, const char* chars, int length, uint32_t hash);
 
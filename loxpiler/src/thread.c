@@ -0,0 +1,194 @@
+#include "thread.h"
+
+#if defined(GC_CONCURRENT) || defined(GC_PARALLEL)
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+
+struct Thread {
+	HANDLE handle;
+	ThreadFn function;
+	void* arg;
+};
+
+struct Mutex {
+	SRWLOCK lock;
+};
+
+struct CondVar {
+	CONDITION_VARIABLE cond;
+};
+
+static DWORD WINAPI thread_entry(LPVOID param) {
+	Thread* thread = (Thread*)param;
+	thread->function(thread->arg);
+	return 0;
+}
+
+Thread* thread_start(ThreadFn function, void* arg) {
+	Thread* thread = (Thread*)malloc(sizeof(Thread));
+	if (thread == NULL)
+		exit(1);
+	thread->function = function;
+	thread->arg = arg;
+	thread->handle = CreateThread(NULL, 0, thread_entry, thread, 0, NULL);
+	if (thread->handle == NULL)
+		exit(1);
+	return thread;
+}
+
+void thread_join(Thread* thread) {
+	WaitForSingleObject(thread->handle, INFINITE);
+	CloseHandle(thread->handle);
+	free(thread);
+}
+
+void thread_yield(void) {
+	SwitchToThread();
+}
+
+int cpu_count(void) {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+}
+
+Mutex* new_mutex(void) {
+	Mutex* mutex = (Mutex*)malloc(sizeof(Mutex));
+	if (mutex == NULL)
+		exit(1);
+	InitializeSRWLock(&mutex->lock);
+	return mutex;
+}
+
+void free_mutex(Mutex* mutex) {
+	free(mutex);
+}
+
+void mutex_lock(Mutex* mutex) {
+	AcquireSRWLockExclusive(&mutex->lock);
+}
+
+void mutex_unlock(Mutex* mutex) {
+	ReleaseSRWLockExclusive(&mutex->lock);
+}
+
+CondVar* new_cond_var(void) {
+	CondVar* cond = (CondVar*)malloc(sizeof(CondVar));
+	if (cond == NULL)
+		exit(1);
+	InitializeConditionVariable(&cond->cond);
+	return cond;
+}
+
+void free_cond_var(CondVar* cond) {
+	free(cond);
+}
+
+void cond_wait(CondVar* cond, Mutex* mutex) {
+	SleepConditionVariableSRW(&cond->cond, &mutex->lock, INFINITE, 0);
+}
+
+void cond_signal(CondVar* cond) {
+	WakeConditionVariable(&cond->cond);
+}
+
+void cond_broadcast(CondVar* cond) {
+	WakeAllConditionVariable(&cond->cond);
+}
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+struct Thread {
+	pthread_t handle;
+	ThreadFn function;
+	void* arg;
+};
+
+struct Mutex {
+	pthread_mutex_t lock;
+};
+
+struct CondVar {
+	pthread_cond_t cond;
+};
+
+static void* thread_entry(void* param) {
+	Thread* thread = (Thread*)param;
+	thread->function(thread->arg);
+	return NULL;
+}
+
+Thread* thread_start(ThreadFn function, void* arg) {
+	Thread* thread = (Thread*)malloc(sizeof(Thread));
+	if (thread == NULL)
+		exit(1);
+	thread->function = function;
+	thread->arg = arg;
+	if (pthread_create(&thread->handle, NULL, thread_entry, thread) != 0)
+		exit(1);
+	return thread;
+}
+
+void thread_join(Thread* thread) {
+	pthread_join(thread->handle, NULL);
+	free(thread);
+}
+
+void thread_yield(void) {
+	sched_yield();
+}
+
+int cpu_count(void) {
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int)count : 1;
+}
+
+Mutex* new_mutex(void) {
+	Mutex* mutex = (Mutex*)malloc(sizeof(Mutex));
+	if (mutex == NULL || pthread_mutex_init(&mutex->lock, NULL) != 0)
+		exit(1);
+	return mutex;
+}
+
+void free_mutex(Mutex* mutex) {
+	pthread_mutex_destroy(&mutex->lock);
+	free(mutex);
+}
+
+void mutex_lock(Mutex* mutex) {
+	pthread_mutex_lock(&mutex->lock);
+}
+
+void mutex_unlock(Mutex* mutex) {
+	pthread_mutex_unlock(&mutex->lock);
+}
+
+CondVar* new_cond_var(void) {
+	CondVar* cond = (CondVar*)malloc(sizeof(CondVar));
+	if (cond == NULL || pthread_cond_init(&cond->cond, NULL) != 0)
+		exit(1);
+	return cond;
+}
+
+void free_cond_var(CondVar* cond) {
+	pthread_cond_destroy(&cond->cond);
+	free(cond);
+}
+
+void cond_wait(CondVar* cond, Mutex* mutex) {
+	pthread_cond_wait(&cond->cond, &mutex->lock);
+}
+
+void cond_signal(CondVar* cond) {
+	pthread_cond_signal(&cond->cond);
+}
+
+void cond_broadcast(CondVar* cond) {
+	pthread_cond_broadcast(&cond->cond);
+}
+#endif
+#endif
\ No newline at end of file
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "common.h"
+
+//Just enough threading for the concurrent and parallel collectors, on top of win32 or pthreads
+typedef struct Thread Thread;
+typedef struct Mutex Mutex;
+typedef struct CondVar CondVar;
+
+typedef void (*ThreadFn)(void* arg);
+
+Thread* thread_start(ThreadFn function, void* arg);
+void thread_join(Thread* thread);
+void thread_yield(void);
+//Processors the machine has, at least 1
+int cpu_count(void);
+
+Mutex* new_mutex(void);
+void free_mutex(Mutex* mutex);
+void mutex_lock(Mutex* mutex);
+void mutex_unlock(Mutex* mutex);
+
+CondVar* new_cond_var(void);
+void free_cond_var(CondVar* cond);
+//Mutex has to be locked, it's unlocked while waiting
+void cond_wait(CondVar* cond, Mutex* mutex);
+void cond_signal(CondVar* cond);
+void cond_broadcast(CondVar* cond);
+
+//Flags and counters several threads look at
+//Claim sets a flag that was false and tells if this thread was the one that did it
+#ifdef _MSC_VER
+#include <intrin.h>
+
+#define THREAD_LOCAL __declspec(thread)
+
+static inline bool flag_claim(bool* flag) {
+	return _InterlockedCompareExchange8((volatile char*)flag, 1, 0) == 0;
+}
+
+//x86 and x64 keep loads and stores in order, only the compiler has to be kept from moving them
+static inline bool flag_load(bool* flag) {
+	bool value = *(volatile bool*)flag;
+	_ReadWriteBarrier();
+	return value;
+}
+
+static inline void flag_store(bool* flag, bool value) {
+	_ReadWriteBarrier();
+	*(volatile bool*)flag = value;
+}
+
+//Sets the bits of mask in word, true if none of them were set before
+static inline bool bits_claim(uint32_t* word, uint32_t mask) {
+	return (_InterlockedOr((volatile long*)word, (long)mask) & mask) == 0;
+}
+
+static inline uint32_t bits_load(uint32_t* word) {
+	uint32_t value = *(volatile uint32_t*)word;
+	_ReadWriteBarrier();
+	return value;
+}
+
+//Returns the new value
+static inline int counter_add(int* counter, int delta) {
+	return _InterlockedExchangeAdd((volatile long*)counter, delta) + delta;
+}
+
+static inline int counter_load(int* counter) {
+	int value = *(volatile int*)counter;
+	_ReadWriteBarrier();
+	return value;
+}
+#else
+#define THREAD_LOCAL _Thread_local
+
+static inline bool flag_claim(bool* flag) {
+	bool expected = false;
+	return __atomic_compare_exchange_n(flag, &expected, true, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static inline bool flag_load(bool* flag) {
+	return __atomic_load_n(flag, __ATOMIC_ACQUIRE);
+}
+
+static inline void flag_store(bool* flag, bool value) {
+	__atomic_store_n(flag, value, __ATOMIC_RELEASE);
+}
+
+//Sets the bits of mask in word, true if none of them were set before
+static inline bool bits_claim(uint32_t* word, uint32_t mask) {
+	return (__atomic_fetch_or(word, mask, __ATOMIC_ACQ_REL) & mask) == 0;
+}
+
+static inline uint32_t bits_load(uint32_t* word) {
+	return __atomic_load_n(word, __ATOMIC_ACQUIRE);
+}
+
+//Returns the new value
+static inline int counter_add(int* counter, int delta) {
+	return __atomic_add_fetch(counter, delta, __ATOMIC_ACQ_REL);
+}
+
+static inline int counter_load(int* counter) {
+	return __atomic_load_n(counter, __ATOMIC_ACQUIRE);
+}
+#endif
\ No newline at end of file
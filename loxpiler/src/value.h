@@ -8,6 +8,11 @@
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef GC_COMPRESSED_REFS
+//Reference to an object as it's offset in the heap, 0 is NULL, see from_ref()
+typedef uint32_t Ref;
+#endif
+
 #ifdef NAN_BOXING
 
 #define SIGN_BIT ((uint64_t)0x8000000000000000)
@@ -2,6 +2,7 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
@@ -20,11 +21,32 @@ static Value clock_native(int argCount, Value* args) {
 	return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+static void close_upvalues(Value* last);
+
 static void reset_stack(void) {
+	//A runtime error leaves upvalues open, closures that escaped keep using them after the stack is gone
+	close_upvalues(vm.stack);
+
+	//Give back what a deep recursion left behind so an idle VM stays small
+	//Nothing points into the stacks anymore
+	if (vm.stackCapacity > STACK_INITIAL) {
+		vm.stack = (Value*)realloc(vm.stack, sizeof(Value) * STACK_INITIAL);
+		vm.openUpvalues = (ObjUpvalue**)realloc(vm.openUpvalues, sizeof(ObjUpvalue*) * STACK_INITIAL);
+		if (vm.stack == NULL || vm.openUpvalues == NULL)
+			exit(1);
+		vm.stackCapacity = STACK_INITIAL;
+	}
+
+	if (vm.frameCapacity > FRAMES_INITIAL) {
+		vm.frames = (CallFrame*)realloc(vm.frames, sizeof(CallFrame) * FRAMES_INITIAL);
+		if (vm.frames == NULL)
+			exit(1);
+		vm.frameCapacity = FRAMES_INITIAL;
+	}
+
 	//Point at start of array
 	vm.stackTop = vm.stack;
 	vm.frameCount = 0;
-	vm.openUpvalues = NULL;
 }
 
 static void runtime_error(const char* format, ...) {
@@ -37,12 +59,18 @@ static void runtime_error(const char* format, ...) {
 	fputs("\n", stderr);
 
 	//Print stack trace
+	//Recursion can be very deep, only print the innermost and outermost calls
 	for (int i = vm.frameCount - 1; i >= 0; i--) {
+		if (i == vm.frameCount - 1 - STACK_TRACE_MAX && vm.frameCount > 2 * STACK_TRACE_MAX) {
+			fprintf(stderr, "... %d more calls\n", vm.frameCount - 2 * STACK_TRACE_MAX);
+			i = STACK_TRACE_MAX - 1;
+		}
+
 		CallFrame* frame = &vm.frames[i];
-		ObjFunction* function = frame->closure->function;
+		ObjFunction* function = closure_function(frame->closure);
 		size_t instruction = frame->ip - function->chunk.code - 1;
 		fprintf(stderr, "[line %d] in ",
-			function->chunk.lines[instruction]);
+			get_line(&function->chunk, (int)instruction));
 		if (function->name == NULL) {
 			fprintf(stderr, "script\n");
 		}
@@ -54,6 +82,12 @@ static void runtime_error(const char* format, ...) {
 	reset_stack();
 }
 
+//Heap is over it's limit even after collecting everything, stop the program and let it's objects go
+static void out_of_memory_error(void) {
+	vm.outOfMemory = false;
+	runtime_error("Out of memory.");
+}
+
 static void define_native(const char* name, NativeFn function) {
 	push_stack(OBJ_VAL(copy_string(name, (int)strlen(name))));
 	push_stack(OBJ_VAL(new_native(function)));
@@ -62,20 +96,57 @@ static void define_native(const char* name, NativeFn function) {
 	pop_stack();
 }
 
-void init_vm(void) {
-	reset_stack();
-	vm.objects = NULL;
+void init_vm(const GcOptions* options) {
+	//Call to system malloc: stacks are not managed by GC
+	vm.stack = (Value*)malloc(sizeof(Value) * STACK_INITIAL);
+	vm.openUpvalues = (ObjUpvalue**)malloc(sizeof(ObjUpvalue*) * STACK_INITIAL);
+	vm.frames = (CallFrame*)malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+	if (vm.stack == NULL || vm.openUpvalues == NULL || vm.frames == NULL)
+		exit(1);
+	vm.stackCapacity = STACK_INITIAL;
+	vm.frameCapacity = FRAMES_INITIAL;
+	vm.stackTop = vm.stack;
+	vm.frameCount = 0;
+	memset(vm.openUpvalues, 0, sizeof(ObjUpvalue*) * STACK_INITIAL);
+	for (int i = 0; i < REGION_CLASSES; i++) {
+		vm.regions[i] = NULL;
+		vm.fullRegions[i] = NULL;
+#ifdef GC_PRETENURE
+		vm.tenuredRegions[i] = NULL;
+		vm.tenuredFullRegions[i] = NULL;
+#endif
+	}
+	vm.sweepRegions = NULL;
+	vm.survivedBytes = 0;
 	vm.bytesAllocated = 0;
-	vm.nextGC = (size_t) 1024 * 1024;
+	vm.gcOptions = *options;
+	vm.nextGC = options->minHeap;
+	vm.outOfMemory = false;
 	vm.grayCount = 0;
 	vm.grayCapacity = 0;
 	vm.grayStack = NULL;
+#ifdef GC_COMPRESSED_REFS
+	init_heap();
+#endif
+#ifdef GC_GENERATIONAL
+	init_nursery();
+#endif
+#ifdef GC_INCREMENTAL
+	init_incremental();
+#endif
+#ifdef GC_CONCURRENT
+	init_concurrent();
+#endif
+#ifdef GC_PARALLEL
+	init_parallel();
+#endif
 
 	init_table(&vm.globals);
 	init_table(&vm.strings);
 
 	//Initialize to null so if copy_string triggers a GC it does not read into uninitialized memory
 	vm.initString = NULL;
+	vm.selectorCount = 0;
 	vm.initString = copy_string("init", 4);
 
 	define_native("clock", clock_native);
@@ -87,8 +158,12 @@ void free_vm(void) {
 	//Clear pointer since next line will free it
 	vm.initString = NULL;
 	free_objects();
+	free(vm.stack);
+	free(vm.openUpvalues);
+	free(vm.frames);
 }
 
+//Unchecked: call() made sure the current function has room for everything it pushes
 void push_stack(Value value) {
 	*vm.stackTop = value;
 	vm.stackTop++;
@@ -105,26 +180,100 @@ static Value peek(int distance) {
 	return vm.stackTop[-1 - distance];
 }
 
-static bool call (ObjClosure* closure, int argCount) {
+//Make room for count more values above stackTop
+//Stack moves in memory when it grows, so every pointer into it gets rebased: frame slots, open upvalues and stackTop
+//Open upvalue index grows along with it
+static bool ensure_stack(int count) {
+	int used = (int)(vm.stackTop - vm.stack);
+	if (used + count <= vm.stackCapacity)
+		return true;
 
-	//Too many args passed in
-	if (argCount != closure->function->arity) {
-		runtime_error("Expected %d arguments but got %d.", closure->function->arity, argCount);
+	if (used + count > STACK_MAX)
+		return false;
+
+	int capacity = vm.stackCapacity;
+	while (capacity < used + count) {
+		capacity *= 2;
+	}
+	if (capacity > STACK_MAX)
+		capacity = STACK_MAX;
+
+	//Copy instead of realloc so the old stack is still valid while rebasing
+	Value* stack = (Value*)malloc(sizeof(Value) * capacity);
+	if (stack == NULL)
+		exit(1);
+	memcpy(stack, vm.stack, sizeof(Value) * used);
+
+	for (int i = 0; i < vm.frameCount; i++) {
+		vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+	}
+
+	vm.openUpvalues = (ObjUpvalue**)realloc(vm.openUpvalues, sizeof(ObjUpvalue*) * capacity);
+	if (vm.openUpvalues == NULL)
+		exit(1);
+	memset(vm.openUpvalues + vm.stackCapacity, 0, sizeof(ObjUpvalue*) * (capacity - vm.stackCapacity));
+	for (int i = 0; i < used; i++) {
+		if (vm.openUpvalues[i] != NULL)
+			vm.openUpvalues[i]->location = stack + i;
+	}
+
+	free(vm.stack);
+	vm.stack = stack;
+	vm.stackTop = stack + used;
+	vm.stackCapacity = capacity;
+	return true;
+}
+
+//Frames only hold pointers into the value stack, nothing points into the frame array itself
+//run() refreshes it's cached frame after every call
+static bool grow_frames(void) {
+	if (vm.frameCapacity >= FRAMES_MAX)
+		return false;
+
+	int capacity = vm.frameCapacity * 2;
+	if (capacity > FRAMES_MAX)
+		capacity = FRAMES_MAX;
+
+	vm.frames = (CallFrame*)realloc(vm.frames, sizeof(CallFrame) * capacity);
+	if (vm.frames == NULL)
+		exit(1);
+	vm.frameCapacity = capacity;
+	return true;
+}
+
+//Frame setup without the arity check, callers made sure argCount is right
+static bool push_frame(ObjClosure* closure, int argCount) {
+	if (vm.frameCount == vm.frameCapacity && !grow_frames()) {
+		runtime_error("Stack overflow.");
 		return false;
 	}
 
-	if (vm.frameCount == FRAMES_MAX) {
+	//Only stack check for the whole call, compiler worked out how many slots the function needs at most
+	//Callee + args are already on the stack
+	if (!ensure_stack(closure_function(closure)->maxStack - argCount - 1 + STACK_SLACK)) {
 		runtime_error("Stack overflow.");
 		return false;
 	}
 
 	CallFrame* frame = &vm.frames[vm.frameCount++];
 	frame->closure = closure;
-	frame->ip = closure->function->chunk.code;
+	frame->ip = closure_function(closure)->chunk.code;
 	frame->slots = vm.stackTop - argCount - 1;
+	frame->captured = false;
 	return true;
 }
 
+static bool call (ObjClosure* closure, int argCount) {
+
+	//Too many args passed in
+	if (argCount != closure_function(closure)->arity) {
+		runtime_error("Expected %d arguments but got %d.", closure_function(closure)->arity, argCount);
+		return false;
+	}
+
+	return push_frame(closure, argCount);
+}
+
 static bool call_value(Value callee, int argCount) {
 	if(IS_OBJ(callee)) {
 		switch (OBJ_TYPE(callee)) {
@@ -142,9 +291,8 @@ static bool call_value(Value callee, int argCount) {
 				ObjClass* klass = AS_CLASS(callee);
 				vm.stackTop[-argCount - 1] = OBJ_VAL(new_instance(klass));
 
-				Value initializer;
-				if (table_get(&klass->methods, vm.initString, &initializer)) {
-					return call(AS_CLOSURE(initializer), argCount);
+				if (klass->initializer != NULL) {
+					return call(klass->initializer, argCount);
 				} else if (argCount != 0) {
 					//If there is no init method it makes no sense to pass arguments when creating an instance
 					runtime_error("Expected 0 arguments but got %d.",argCount);
@@ -173,17 +321,91 @@ static bool call_value(Value callee, int argCount) {
 	return false;
 }
 
+//Shared cache of the sites past the 16 bit index must stay empty, it would hit for a site that called something else
+static inline bool cacheable(CallCache* cache, ObjFunction* function) {
+	return cache - function->callCaches != CALL_CACHE_SHARED;
+}
+
+//call_value for OP_CALL sites: same callee as last time means the arity was already checked for this argCount
+//Cache belongs to function
+static bool call_cached(Value callee, int argCount, CallCache* cache, ObjFunction* function) {
+	if (IS_OBJ(callee) && AS_OBJ(callee) == cache->callee) {
+		if (cache->native != NULL) {
+			Value result = cache->native(argCount, vm.stackTop - argCount);
+			vm.stackTop -= argCount + 1;
+			push_stack(result);
+			return true;
+		}
+
+		//Class is still in it's slot while the instance gets allocated so a GC can't free it
+		if (cache->klass != NULL) {
+#ifdef GC_PRETENURE
+			use_alloc_site(&cache->site);
+#endif
+			vm.stackTop[-argCount - 1] = OBJ_VAL(new_instance(cache->klass));
+		}
+
+		//Class without init has nothing to call
+		if (cache->closure == NULL)
+			return true;
+		return push_frame(cache->closure, argCount);
+	}
+
+#ifdef GC_PRETENURE
+	//Instance call_value creates belongs to this site too
+	if (IS_CLASS(callee))
+		use_alloc_site(&cache->site);
+#endif
+	if (!call_value(callee, argCount))
+		return false;
+
+	//Only cache what call_value accepted, bound methods are a new object every time so don't bother with those
+	if (!IS_OBJ(callee) || !cacheable(cache, function))
+		return true;
+	write_barrier((Obj*)function, callee);
+	switch (OBJ_TYPE(callee)) {
+		case OBJ_CLOSURE:
+			cache->callee = AS_OBJ(callee);
+			cache->closure = AS_CLOSURE(callee);
+			cache->klass = NULL;
+			cache->native = NULL;
+			break;
+
+		case OBJ_NATIVE:
+			cache->callee = AS_OBJ(callee);
+			cache->closure = NULL;
+			cache->klass = NULL;
+			cache->native = AS_NATIVE(callee);
+			break;
+
+		case OBJ_CLASS: {
+			//Methods can't change after the class body ran, so init stays the same
+			ObjClass* klass = AS_CLASS(callee);
+			write_barrier((Obj*)function, OBJ_VAL(klass->initializer));
+			cache->callee = AS_OBJ(callee);
+			cache->closure = klass->initializer;
+			cache->klass = klass;
+			cache->native = NULL;
+			break;
+		}
+
+		default:
+			break;
+	}
+	return true;
+}
+
 static bool invoke_from_class(ObjClass* klass, ObjString* name, int argCount) {
 	//Get method from class by name and call it
-	Value method;
-	if (!table_get(&klass->methods, name, &method)) {
+	ObjClosure* method = find_method(klass, name);
+	if (method == NULL) {
 		runtime_error("Undefined property '%s'.", name->chars);
 		return false;
 	}
 	//Push call onto call frame
 	//No need to create a BoundMethod or juggle stack
 	//Everything is already where it should be
-	return call(AS_CLOSURE(method), argCount);
+	return call(method, argCount);
 }
 
 static bool invoke(ObjString* name, int argCount) {
@@ -212,16 +434,55 @@ static bool invoke(ObjString* name, int argCount) {
 	return invoke_from_class(instance->klass, name, argCount);
 }
 
+//Superclass methods are fixed once the class body ran, so a super site keeps getting the same closure for the same superclass
+//A class declared inside a function gets a new superclass every time it runs, so the cache is keyed on it
+static ObjClosure* resolve_super(ObjClass* superclass, ObjString* name, CallCache* cache, ObjFunction* function) {
+	if ((Obj*)superclass == cache->callee)
+		return cache->closure;
+
+	ObjClosure* method = find_method(superclass, name);
+	if (method == NULL) {
+		runtime_error("Undefined property '%s'.", name->chars);
+		return NULL;
+	}
+	if (!cacheable(cache, function))
+		return method;
+	write_barrier((Obj*)function, OBJ_VAL(superclass));
+	write_barrier((Obj*)function, OBJ_VAL(method));
+	cache->callee = (Obj*)superclass;
+	cache->closure = method;
+	return method;
+}
+
+//Cache miss of OP_SUPER_INVOKE, only cache the method once the arity check passed
+static bool invoke_super(ObjClass* superclass, ObjString* name, int argCount, CallCache* cache, ObjFunction* function) {
+	ObjClosure* method = find_method(superclass, name);
+	if (method == NULL) {
+		runtime_error("Undefined property '%s'.", name->chars);
+		return false;
+	}
+	if (!call(method, argCount))
+		return false;
+	if (!cacheable(cache, function))
+		return true;
+
+	write_barrier((Obj*)function, OBJ_VAL(superclass));
+	write_barrier((Obj*)function, OBJ_VAL(method));
+	cache->callee = (Obj*)superclass;
+	cache->closure = method;
+	return true;
+}
+
 static bool bind_method(ObjClass* klass, ObjString* name) {
 	//Look for method with given name in given class
-	Value method;
-	if(!table_get(&klass->methods, name, &method)) {
+	ObjClosure* method = find_method(klass, name);
+	if (method == NULL) {
 		runtime_error("Undefined property '%s'.", name->chars);
 		return false;
 	}
 	//Wrap method in BoundMethod together with receiver
 	//The instance which is the receiver is on top of stack
-	ObjBoundMethod* bound = new_bound_method(peek(0), AS_CLOSURE(method));
+	ObjBoundMethod* bound = new_bound_method(peek(0), method);
 
 	//Replace values on stack: pop receiver and push bound method
 	pop_stack();
@@ -229,50 +490,69 @@ static bool bind_method(ObjClass* klass, ObjString* name) {
 	return true;
 }
 
+//Closures capturing the same local share 1 upvalue
 static ObjUpvalue* capture_upvalue(Value* local) {
-
-	ObjUpvalue* prevUpvalue = NULL;
-	ObjUpvalue* upvalue = vm.openUpvalues;
-	while (upvalue != NULL && upvalue->location > local) {
-		prevUpvalue = upvalue;
-		upvalue = upvalue->next;
-	}
-
-	if (upvalue != NULL && upvalue->location == local) {
-		return upvalue;
+	int slot = (int)(local - vm.stack);
+	if (vm.openUpvalues[slot] != NULL) {
+#ifdef GC_PRETENURE
+		//Site the caller set has nothing to allocate
+		vm.allocSite = 0;
+#endif
+		return vm.openUpvalues[slot];
 	}
 
-	ObjUpvalue* createdUpvalue = new_upvalue(local);
+	ObjUpvalue* upvalue = new_upvalue(local);
+	vm.openUpvalues[slot] = upvalue;
+	return upvalue;
+}
 
-	createdUpvalue->next = upvalue;
+//Local goes out of scope: move it's value into the upvalue
+static void close_upvalue(Value* local) {
+	ObjUpvalue** open = &vm.openUpvalues[local - vm.stack];
+	if (*open == NULL)
+		return;
 
-	if (prevUpvalue == NULL) {
-		vm.openUpvalues = createdUpvalue;
-	}
-	else {
-		prevUpvalue->next = createdUpvalue;
-	}
-
-	return createdUpvalue;
+	write_barrier((Obj*)*open, *local);
+	(*open)->closed = *local;
+	(*open)->location = &(*open)->closed;
+	*open = NULL;
 }
 
+//Close every open upvalue from last up to the top of the stack
 static void close_upvalues(Value* last) {
-	while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-		ObjUpvalue* upvalue = vm.openUpvalues;
-		upvalue->closed = *upvalue->location;
-		upvalue->location = &upvalue->closed;
-		vm.openUpvalues = upvalue->next;
+	for (Value* slot = last; slot < vm.stackTop; slot++) {
+		close_upvalue(slot);
 	}
 }
 
+//Pop frame for a tail call
+//Callee + args slide down to where the frame's slots begin, so when the callee returns it's result lands where ours would have
+//If the callee is a closure, call() pushes it's frame into the CallFrame we just released
+//Natives and classes without init leave their result in that spot, which is the same as returning it
+static void leave_frame(CallFrame* frame, int argCount) {
+	if (frame->captured)
+		close_upvalues(frame->slots);
+
+	Value* callee = vm.stackTop - argCount - 1;
+	memmove(frame->slots, callee, sizeof(Value) * (argCount + 1));
+	vm.stackTop = frame->slots + argCount + 1;
+	vm.frameCount--;
+}
+
 static void define_method(ObjString* name) {
 	//Closure on top of stack
 	Value method = peek(0);
 	//Class sits after the closure
 	ObjClass* klass = AS_CLASS(peek(1));
+	//Methods table, vtable and initializer all get the same closure
+	write_barrier((Obj*)klass, method);
+	write_barrier((Obj*)klass, OBJ_VAL(name));
 
 	//Set method in the table of specified class
 	table_set(&klass->methods, name, method);
+	set_vtable_method(klass, name, AS_CLOSURE(method));
+	if (name == vm.initString)
+		klass->initializer = AS_CLOSURE(method);
 	//Pop closure
 	pop_stack();
 }
@@ -300,6 +580,10 @@ static void concatenate(void) {
 static InterpretResult run(void) {
 	//Store current topmost frame
 	CallFrame* frame = &vm.frames[vm.frameCount - 1];
+	//Index operand of the current instruction
+	//Instructions that can be OP_WIDE prefixed read their operand into arg and OP_WIDE jumps to the label right after that read
+	//This way the compact form stays as fast as before and the long form shares the same handler
+	uint32_t arg;
 
 #define READ_BYTE() (*frame->ip++)
 	//Yank next 2 bytes out of code and build a 16bit integer
@@ -307,10 +591,36 @@ static InterpretResult run(void) {
     (frame->ip += 2, \
     (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 
-#define READ_CONSTANT() \
-    (frame->closure->function->chunk.constants.values[READ_BYTE()])
+	//Operand of a OP_WIDE instruction
+#define READ_UINT24() \
+    (frame->ip += 3, \
+    (uint32_t)((frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]))
+
+	//Constant at the index operand already read into arg (1 byte or OP_WIDE form)
+#define ARG_CONSTANT() (closure_function(frame->closure)->chunk.constants.values[arg])
+#define ARG_STRING() AS_STRING(ARG_CONSTANT())
+
+	//Minor collections move objects, they can only run between instructions where nothing but the roots holds on to one
+	//Every loop iteration and call passes one, straight line code in between only allocates so much
+	//Heap going over it's limit stops the program at the next one too
+#ifdef GC_GENERATIONAL
+#define SAFEPOINT() \
+    do { \
+      if (vm.nurseryTop > vm.nurseryLimit && !gc_safepoint()) { \
+        out_of_memory_error(); \
+        return INTERPRET_RUNTIME_ERROR; \
+      } \
+    } while (false)
+#else
+#define SAFEPOINT() \
+    do { \
+      if (vm.outOfMemory) { \
+        out_of_memory_error(); \
+        return INTERPRET_RUNTIME_ERROR; \
+      } \
+    } while (false)
+#endif
 
-#define READ_STRING() AS_STRING(READ_CONSTANT())
 	//Do while is a trick to make sure every statement is in same scope
 	//And can use a semicolon at end
 	#define BINARY_OP(valueType, op) \
@@ -334,8 +644,8 @@ static InterpretResult run(void) {
 			printf(" ] ");
 		}
 		printf("TOP\n");
-		disassemble_instruction(&frame->closure->function->chunk,
-			(int)(frame->ip - frame->closure->function->chunk.code));
+		disassemble_instruction(&closure_function(frame->closure)->chunk,
+			(int)(frame->ip - closure_function(frame->closure)->chunk.code));
 #endif
 		uint8_t instruction;
 
@@ -343,6 +653,9 @@ static InterpretResult run(void) {
 		switch (instruction = READ_BYTE()) {
 			case OP_RETURN: {
 				Value result = pop_stack();
+				//Locals of the returning function that are captured by a closure move to the heap
+				if (frame->captured)
+					close_upvalues(frame->slots);
 				vm.frameCount--;
 				if(vm.frameCount == 0) {
 					pop_stack();
@@ -352,37 +665,43 @@ static InterpretResult run(void) {
 				vm.stackTop = frame->slots;
 				push_stack(result);
 				frame = &vm.frames[vm.frameCount - 1];
+				SAFEPOINT();
 				break;
 			}
 
-			case OP_CONSTANT: {
-				Value constant = READ_CONSTANT();
-				push_stack(constant);
+			case OP_CONSTANT:
+				arg = READ_BYTE();
+			op_constant:
+				push_stack(ARG_CONSTANT());
 				break;
-			}
+
 			case OP_NIL: push_stack(NIL_VAL); break;
 			case OP_TRUE: push_stack(BOOL_VAL(true)); break;
 			case OP_FALSE: push_stack(BOOL_VAL(false)); break;
 			case OP_POP: pop_stack(); break;
-			case OP_GET_LOCAL: {
+			case OP_GET_LOCAL:
 				//Get stack slot index from local var from instruction operand 
-				uint8_t slot = READ_BYTE();
+				arg = READ_BYTE();
+			op_get_local:
 				//Instructions work with data on top of stack
 				//Push value on top of stack (copy)
-				push_stack(frame->slots[slot]);
+				push_stack(frame->slots[arg]);
 				break;
-			}
-			case OP_SET_LOCAL: {
+
+			case OP_SET_LOCAL:
 				//Get stack slot index from local var from instruction operand 
-				uint8_t slot = READ_BYTE();
+				arg = READ_BYTE();
+			op_set_local:
 				//Set that var to last value pushed on stack
 				//Don't pop of stack
 				//Value of assignment expression = the assigned value
-				frame->slots[slot] = peek(0);
+				frame->slots[arg] = peek(0);
 				break;
-			}
-			case OP_GET_GLOBAL: {
-				ObjString* name = READ_STRING();
+
+			case OP_GET_GLOBAL:
+				arg = READ_BYTE();
+			op_get_global: {
+				ObjString* name = ARG_STRING();
 				Value value;
 				if(!table_get(&vm.globals, name, &value)) {
 					runtime_error("Undefined variable '%s'.", name->chars);
@@ -391,14 +710,18 @@ static InterpretResult run(void) {
 				push_stack(value);
 				break;
 			}
-			case OP_DEFINE_GLOBAL: {
-				ObjString* name = READ_STRING();
+			case OP_DEFINE_GLOBAL:
+				arg = READ_BYTE();
+			op_define_global: {
+				ObjString* name = ARG_STRING();
 				table_set(&vm.globals, name, peek(0));
 				pop_stack();
 				break;
 			}
-			case OP_SET_GLOBAL: {
-				ObjString* name = READ_STRING();
+			case OP_SET_GLOBAL:
+				arg = READ_BYTE();
+			op_set_global: {
+				ObjString* name = ARG_STRING();
 				//If table_set returns true, it means we defined a new entry
 				//And did not reassign an existing var
 				//So we delete it again and return an error
@@ -410,19 +733,31 @@ static InterpretResult run(void) {
 				break;
 			}
 
-			case OP_GET_UPVALUE: {
-				uint8_t slot = READ_BYTE();
-				push_stack(*frame->closure->upvalues[slot]->location);
+			case OP_GET_UPVALUE:
+				arg = READ_BYTE();
+			op_get_upvalue:
+				push_stack(*AS_UPVALUE(frame->closure->upvalues[arg])->location);
 				break;
-			}
 
-			case OP_SET_UPVALUE: {
-				uint8_t slot = READ_BYTE();
-				*frame->closure->upvalues[slot]->location = peek(0);
+			case OP_SET_UPVALUE:
+				arg = READ_BYTE();
+			op_set_upvalue: {
+				ObjUpvalue* upvalue = AS_UPVALUE(frame->closure->upvalues[arg]);
+				//Closed upvalue holds the value itself
+				write_barrier((Obj*)upvalue, peek(0));
+				*upvalue->location = peek(0);
 				break;
 			}
 
-			case OP_GET_PROPERTY: {
+			case OP_GET_CAPTURED:
+				arg = READ_BYTE();
+			op_get_captured:
+				push_stack(frame->closure->upvalues[arg]);
+				break;
+
+			case OP_GET_PROPERTY:
+				arg = READ_BYTE();
+			op_get_property: {
 
 				if (!IS_INSTANCE(peek(0))) {
 					runtime_error("Only instances have properties.");
@@ -430,7 +765,7 @@ static InterpretResult run(void) {
 				}
 
 				ObjInstance* instance = AS_INSTANCE(peek(0));
-				ObjString* name = READ_STRING();
+				ObjString* name = ARG_STRING();
 
 				//Find field or method with given name
 				//Replace top of stack with the accessed property
@@ -451,14 +786,64 @@ static InterpretResult run(void) {
 				break;
 			}
 
-			case OP_SET_PROPERTY: {
+			case OP_GET_METHOD:
+				arg = READ_BYTE();
+			op_get_method: {
+				if (!IS_INSTANCE(peek(0))) {
+					runtime_error("Only instances have properties.");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+
+				ObjInstance* instance = AS_INSTANCE(peek(0));
+				ObjString* name = ARG_STRING();
+
+				//Field: no receiver to bind to, nil tells OP_BIND_METHOD to leave the value alone
+				Value value;
+				if (table_get(&instance->fields, name, &value)) {
+					vm.stackTop[-1] = NIL_VAL;
+					push_stack(value);
+					break;
+				}
+
+				ObjClosure* method = find_method(instance->klass, name);
+				if (method == NULL) {
+					runtime_error("Undefined property '%s'.", name->chars);
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				push_stack(OBJ_VAL(method));
+				break;
+			}
+
+			case OP_BIND_METHOD: {
+				//Method stays in it's local while the bound method gets allocated
+				Value method = pop_stack();
+				if (!IS_NIL(peek(0)) && IS_CLOSURE(method)) {
+					vm.stackTop[-1] = OBJ_VAL(new_bound_method(peek(0), AS_CLOSURE(method)));
+				}
+				else {
+					//Field value or already bound
+					vm.stackTop[-1] = method;
+				}
+				break;
+			}
+
+			case OP_SET_PROPERTY:
+				arg = READ_BYTE();
+			op_set_property: {
 				if (!IS_INSTANCE(peek(1))) {
 					runtime_error("Only instances have properties.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
 				ObjInstance* instance = AS_INSTANCE(peek(1));
-				table_set(&instance->fields, READ_STRING(), peek(0));
+				write_barrier((Obj*)instance, OBJ_VAL(ARG_STRING()));
+				write_barrier((Obj*)instance, peek(0));
+				//Learn how many fields instances of this class get
+				if (table_set(&instance->fields, ARG_STRING(), peek(0))
+					&& instance->fields.size > instance->klass->fieldCount
+					&& instance->fields.size <= FIELDS_RESERVE_MAX) {
+					instance->klass->fieldCount = instance->fields.size;
+				}
 
 				//Setter is an expression that results in the assigned value, so we need to leave that opn the stack
 				Value value = pop_stack();
@@ -467,17 +852,23 @@ static InterpretResult run(void) {
 				break;
 			}
 
-			case OP_GET_SUPER: {
-
+			case OP_GET_SUPER:
+				arg = READ_BYTE();
+			op_get_super: {
 				//Get method name for superclass
-				ObjString* name = READ_STRING();
+				ObjString* name = ARG_STRING();
+				CallCache* cache = &closure_function(frame->closure)->callCaches[READ_SHORT()];
 				//Get superclass and pop it from stack to leave instance at top of stack
 				//When bind_method succeeds it pops off the instance and pushes the BoundMethod
 				ObjClass* superclass = AS_CLASS(pop_stack());
-				//Pass superclass and method name to create a BoundMethod to bundle closure and instance
-				if(!bind_method(superclass, name)) {
+				ObjClosure* method = resolve_super(superclass, name, cache, closure_function(frame->closure));
+				if (method == NULL) {
 					return INTERPRET_RUNTIME_ERROR;
 				}
+				//Bundle closure and instance
+				ObjBoundMethod* bound = new_bound_method(peek(0), method);
+				pop_stack();
+				push_stack(OBJ_VAL(bound));
 				//This heaps allocate a BoundMethod Obj every time, most of the time we want to invoke a supercall and the next instruction will be a OP_CALL that will unpack the BoundMethod and discard it
 				//Compiler can tell if we immediately invoke it or not so we optimize supercalls to directly invoke it
 				break;
@@ -529,41 +920,66 @@ static InterpretResult run(void) {
 				printf("\n");
 				break;
 			}
-			case OP_JUMP: {
+			case OP_JUMP:
 				//Save offset in 16bit int (saved in 2 bytes)
-				uint16_t offset = READ_SHORT();
+				arg = READ_SHORT();
+			op_jump:
 				//Unconditional jump
-				frame->ip += offset;
+				frame->ip += arg;
 				break;
-			}
-			case OP_LOOP: {
+
+			case OP_LOOP:
 				//Save offset in 16bit int (saved in 2 bytes)
-				uint16_t offset = READ_SHORT();
+				arg = READ_SHORT();
+			op_loop:
 				//Unconditional jump backwards
-				frame->ip -= offset;
+				frame->ip -= arg;
+				SAFEPOINT();
 				break;
-			}
+
 			case OP_JUMP_IF_FALSE:
 				//Save offset in 16bit int (saved in 2 bytes)
-				uint16_t offset = READ_SHORT();
+				arg = READ_SHORT();
+			op_jump_if_false:
 				//Check cond
 				if(is_falsey(peek(0))) {
-					frame->ip += offset;
+					frame->ip += arg;
 				}
 				break;
 
 			case OP_CALL: {
 				int argCount = READ_BYTE();
-				if (!call_value(peek(argCount), argCount)) {
+				ObjFunction* function = closure_function(frame->closure);
+				CallCache* cache = &function->callCaches[READ_SHORT()];
+				if (!call_cached(peek(argCount), argCount, cache, function)) {
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				frame = &vm.frames[vm.frameCount - 1];
+				SAFEPOINT();
+				break;
+			}
+
+			case OP_CALL_METHOD: {
+				int argCount = READ_BYTE();
+				//Receiver already sits in the callee slot
+				//A plain closure from a field gets nil there, which it never looks at
+				Value method = pop_stack();
+				bool called = IS_CLOSURE(method)
+					? call(AS_CLOSURE(method), argCount)
+					: call_value(method, argCount);
+				if (!called) {
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				frame = &vm.frames[vm.frameCount - 1];
+				SAFEPOINT();
 				break;
 			}
 
-			case OP_INVOKE: {
+			case OP_INVOKE:
+				arg = READ_BYTE();
+			op_invoke: {
 				//Get method name and arg count
-				ObjString* method = READ_STRING();
+				ObjString* method = ARG_STRING();
 				int argCount = READ_BYTE();
 				
 				if (!invoke(method, argCount)) {
@@ -571,52 +987,131 @@ static InterpretResult run(void) {
 				}
 				//if success there is new call frame on stack so refresh cached frame
 				frame = &vm.frames[vm.frameCount - 1];
+				SAFEPOINT();
 				break;
 			}
 
-			case OP_SUPER_INVOKE: {
+			case OP_TAIL_CALL: {
+				int argCount = READ_BYTE();
+				//Look up the cache before the frame is gone
+				ObjFunction* function = closure_function(frame->closure);
+				CallCache* cache = &function->callCaches[READ_SHORT()];
+				//Current function is done: drop it's frame and let the callee take over it's stack window
+				leave_frame(frame, argCount);
+				if (!call_cached(peek(argCount), argCount, cache, function)) {
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				frame = &vm.frames[vm.frameCount - 1];
+				SAFEPOINT();
+				break;
+			}
+
+			case OP_TAIL_INVOKE:
+				arg = READ_BYTE();
+			op_tail_invoke: {
+				ObjString* method = ARG_STRING();
+				int argCount = READ_BYTE();
+				leave_frame(frame, argCount);
+				if (!invoke(method, argCount)) {
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				frame = &vm.frames[vm.frameCount - 1];
+				SAFEPOINT();
+				break;
+			}
+
+			case OP_SUPER_INVOKE:
+				arg = READ_BYTE();
+			op_super_invoke: {
 				//Get method name and arg count
-				ObjString* method = READ_STRING();
+				ObjString* method = ARG_STRING();
 				int argCount = READ_BYTE();
+				CallCache* cache = &closure_function(frame->closure)->callCaches[READ_SHORT()];
 				//Get superclass from stack and pop it off so stack is set up right for a method call
 				ObjClass* superclass = AS_CLASS(pop_stack());
-				//Look up given function by name and create a call for it
+				//Same superclass as last time: arity was checked then, call the closure right away
 				//Pushes new frame on callstack if success 
-				if (!invoke_from_class(superclass, method, argCount)) {
+				bool called = (Obj*)superclass == cache->callee
+					? push_frame(cache->closure, argCount)
+					: invoke_super(superclass, method, argCount, cache, closure_function(frame->closure));
+				if (!called) {
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				//Refresh frame
 				frame = &vm.frames[vm.frameCount - 1];
+				SAFEPOINT();
 				break;
 			}
 
-			case OP_CLOSURE: {
-				ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+			case OP_CLOSURE:
+				arg = READ_BYTE();
+			op_closure: {
+				ObjFunction* function = AS_FUNCTION(ARG_CONSTANT());
+#ifdef GC_PRETENURE
+				CallCache* cache = &closure_function(frame->closure)->callCaches[READ_SHORT()];
+#endif
+
+				//Nothing to capture: every closure of the function would be the same, hand out the shared one
+				if (function->upvalueCount == 0) {
+					if (function->closure == NULL) {
+						ObjClosure* closure = new_closure(function);
+						write_barrier((Obj*)function, OBJ_VAL(closure));
+						function->closure = closure;
+					}
+					push_stack(OBJ_VAL(function->closure));
+					break;
+				}
+
+#ifdef GC_PRETENURE
+				use_alloc_site(&cache->site);
+#endif
 				ObjClosure* closure = new_closure(function);
 				push_stack(OBJ_VAL(closure));
 
 				for (int i = 0; i < closure->upvalueCount; i++) {
-					uint8_t isLocal = READ_BYTE();
-					uint8_t index = READ_BYTE();
-					if (isLocal) {
-						closure->upvalues[i] = capture_upvalue(frame->slots + index);
+					uint8_t flags = READ_BYTE();
+					uint16_t index = (flags & UPVALUE_WIDE) ? READ_SHORT() : READ_BYTE();
+					if (!(flags & UPVALUE_LOCAL)) {
+						//ObjUpvalue or captured value of the enclosing closure, copying works for both
+						closure->upvalues[i] = frame->closure->upvalues[index];
+					}
+					else if (flags & UPVALUE_VALUE) {
+						//Local is never assigned, a copy is as good as sharing it
+						closure->upvalues[i] = frame->slots[index];
 					}
 					else {
-						closure->upvalues[i] = frame->closure->upvalues[index];
+#ifdef GC_PRETENURE
+						//Upvalue lives as long as the closure, a new one is allocated for the same site
+						use_alloc_site(&cache->site);
+#endif
+						closure->upvalues[i] = OBJ_VAL(capture_upvalue(frame->slots + index));
+						frame->captured = true;
 					}
 				}
+#ifdef GC_PRETENURE
+				//Pretenured closure is not remembered, the upvalues it just got may be young
+				if (!is_young((Obj*)closure)) {
+					for (int i = 0; i < closure->upvalueCount; i++) {
+						write_barrier((Obj*)closure, closure->upvalues[i]);
+					}
+				}
+#endif
 				break;
 			}
 			case OP_CLOSE_UPVALUE: {
-				close_upvalues(vm.stackTop - 1);
+				close_upvalue(vm.stackTop - 1);
 				pop_stack();
 				break;
 			}
 
-			case OP_CLASS: {
-				push_stack(OBJ_VAL(new_class(READ_STRING())));
+			case OP_CLASS:
+				arg = READ_BYTE();
+			op_class:
+#ifdef GC_PRETENURE
+				use_alloc_site(&closure_function(frame->closure)->callCaches[READ_SHORT()].site);
+#endif
+				push_stack(OBJ_VAL(new_class(ARG_STRING())));
 				break;
-			}
 
 			case OP_INHERIT:
 				//Get superclass and check if it is a class
@@ -626,24 +1121,63 @@ static InterpretResult run(void) {
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				ObjClass* subclass = AS_CLASS(peek(0));
+				write_barrier_bulk((Obj*)subclass);
 				//Copy over all methods from super class to subclass
 				//Table from subclass is empty so any method the subclass overrides will overwrite these entries
 				table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
+				inherit_vtable(subclass, AS_CLASS(superclass));
+				//Inherited init, unless the subclass defines it's own later on
+				subclass->initializer = AS_CLASS(superclass)->initializer;
 				//Pop subclass
 				pop_stack();
 				break;
 
 			case OP_METHOD:
-				define_method(READ_STRING());
+				arg = READ_BYTE();
+			op_method:
+				define_method(ARG_STRING());
+				break;
+
+			case OP_WIDE:
+				//Long form of the next instruction: 24 bit operand
+				instruction = READ_BYTE();
+				arg = READ_UINT24();
+
+				switch (instruction) {
+					case OP_CONSTANT:      goto op_constant;
+					case OP_GET_LOCAL:     goto op_get_local;
+					case OP_SET_LOCAL:     goto op_set_local;
+					case OP_GET_GLOBAL:    goto op_get_global;
+					case OP_DEFINE_GLOBAL: goto op_define_global;
+					case OP_SET_GLOBAL:    goto op_set_global;
+					case OP_GET_UPVALUE:   goto op_get_upvalue;
+					case OP_SET_UPVALUE:   goto op_set_upvalue;
+					case OP_GET_CAPTURED:  goto op_get_captured;
+					case OP_GET_PROPERTY:  goto op_get_property;
+					case OP_SET_PROPERTY:  goto op_set_property;
+					case OP_GET_METHOD:    goto op_get_method;
+					case OP_GET_SUPER:     goto op_get_super;
+					case OP_JUMP:          goto op_jump;
+					case OP_JUMP_IF_FALSE: goto op_jump_if_false;
+					case OP_LOOP:          goto op_loop;
+					case OP_INVOKE:        goto op_invoke;
+					case OP_SUPER_INVOKE:  goto op_super_invoke;
+					case OP_TAIL_INVOKE:   goto op_tail_invoke;
+					case OP_CLOSURE:       goto op_closure;
+					case OP_CLASS:         goto op_class;
+					case OP_METHOD:        goto op_method;
+				}
 				break;
 		}
 	}
 
 #undef READ_BYTE
-#undef READ_CONSTANT
 #undef READ_SHORT
-#undef READ_STRING
+#undef READ_UINT24
+#undef ARG_CONSTANT
+#undef ARG_STRING
 #undef BINARY_OP
+#undef SAFEPOINT
 
 }
 
@@ -663,5 +1197,9 @@ InterpretResult interpret(const char* source) {
 	push_stack(OBJ_VAL(closure));
 	call(closure, 0);
 
-	return run();
+	InterpretResult result = run();
+	//Runtime errors already reset the stacks
+	if (result == INTERPRET_OK)
+		reset_stack();
+	return result;
 }
\ No newline at end of file
@@ -3,10 +3,19 @@
 #include "chunk.h"
 #include "object.h"
 #include "table.h"
+#include "thread.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+//Both stacks start small and grow on demand
+#define FRAMES_INITIAL 16
+#define STACK_INITIAL (UINT8_COUNT * 2)
+//Recursion deeper than this is reported as a stack overflow
+#define FRAMES_MAX (1024 * 1024)
+#define STACK_MAX (16 * 1024 * 1024)
+//Free slots on top of what a function needs for values the VM pushes itself to keep them safe from the GC
+#define STACK_SLACK 4
+//Calls printed on each end of the stack trace of a runtime error
+#define STACK_TRACE_MAX 16
 
 //Each function invocation tracks where locals begin + where caller should return after fn
 typedef struct {
@@ -16,16 +25,95 @@ typedef struct {
 	uint8_t* ip;
 	//First slot fn can use in VM value stack
 	Value* slots;
+	//Set when a closure captured one of the frame's locals, returning only has to close upvalues then
+	bool captured;
 } CallFrame;
 
+//Gray objects handed between threads by the concurrent collector
 typedef struct {
-	CallFrame frames[FRAMES_MAX];
+	int count;
+	int capacity;
+	Obj** objects;
+} GrayStack;
+
+//Old objects the collector knows about, swept a region at a time
+typedef struct Region Region;
+
+#ifdef GC_PRETENURE
+//What minor collections found out about the objects of one OP_CALL, OP_CLOSURE or OP_CLASS
+typedef struct {
+	//Young objects of the current sample and how many of them survived their first minor collection
+	int sampled;
+	int survived;
+	//Last sample mostly survived, objects are allocated old
+	bool tenured;
+	//Tenured sites still put 1 object in PRETENURE_RESAMPLE in the nursery to notice when that changes
+	int skipped;
+} AllocSite;
+
+//Young object that came from a site, survival is counted once the next minor collection is done with it
+typedef struct {
+	Obj* object;
+	int site;
+} YoungSite;
+#endif
+
+//Objects up to this size go in regions of their size class, bigger ones are allocated on their own
+#define REGION_CELL_MAX 128
+//Size classes are this many bytes apart, the same as object alignment so 24 byte objects don't take 32
+#define REGION_GRANULE 8
+//Class 0 is the large objects, class n holds objects up to n * REGION_GRANULE bytes
+#define REGION_CLASSES (REGION_CELL_MAX / REGION_GRANULE + 1)
+
+#ifdef GC_COMPRESSED_REFS
+//Blocks of the heap are handed out in multiples of this
+#define HEAP_GRANULE 16
+//Freed blocks up to this size are kept in a list per size for the next allocation of that size
+//Bigger ones go on a single first fit list, closures with thousands of upvalues are that big
+#define HEAP_FREE_MAX (64 * 1024)
+#define HEAP_FREE_LISTS (HEAP_FREE_MAX / HEAP_GRANULE + 1)
+
+//Freed block bigger than HEAP_FREE_MAX
+typedef struct FreeBlock FreeBlock;
+#endif
+
+//Gray objects of one marking thread of a parallel collection
+typedef struct MarkWorker MarkWorker;
+
+//Collector settings, main() takes them from the command line and environment variables
+typedef struct {
+	//Heap is never collected below this size, the first collection happens there
+	size_t minHeap;
+	//Pacer starts the next collection once the heap is this many times what survived the last one
+	double heapGrowth;
+	//Most bytes the heap may take, 0 for no limit
+	//Going past it collects everything that can be, a program still over it stops with a runtime error
+	size_t heapLimit;
+	//Incremental collector: longest a single marking or sweeping step may take in microseconds
+	int pauseBudget;
+	//Parallel collector: marking threads including the VM's, 0 for one per processor
+	int markThreads;
+} GcOptions;
+
+//Where the incremental collector is in it's cycle
+typedef enum {
+	GC_IDLE,
+	//Waiting for a safepoint to empty the nursery before marking starts
+	GC_START,
+	GC_MARKING,
+	GC_SWEEPING
+} GcPhase;
+
+typedef struct {
+	CallFrame* frames;
 	int frameCount;
+	int frameCapacity;
 	//instruction pointer, stores location of instruction to be executed next
 	//Sometimes called program counter (pc)
 	//uint8_t* ip;
 
-	Value stack[STACK_MAX];
+	Value* stack;
+	int stackCapacity;
 	//Store pointer instead of index
 	//It is faster to deref a pointer than to index in an array
 	//Same reason we store ip as a pointer
@@ -37,18 +125,112 @@ typedef struct {
 	Table strings;
 	//Store an object for "init" string to speed up instance constructing because for calling the initializer  the runtime looks it up by name
 	ObjString* initString;
-	//Open upvalues still on stack
-	ObjUpvalue* openUpvalues;
+	//Selector ids handed out to method names so far
+	int selectorCount;
+	//Open upvalues still on stack, indexed by stack slot so capturing is a lookup
+	//NULL for slots nobody captured, same capacity as the stack
+	ObjUpvalue** openUpvalues;
 	//Live memory
 	size_t bytesAllocated;
 	//Threshold to trigger gc
+	//Incremental collector does it's next step there while a cycle is running
 	size_t nextGC;
-	//Head of all allocated objects to track
-	Obj* objects;
+	GcOptions gcOptions;
+	//Heap is over it's limit even after collecting, the next safepoint raises a runtime error
+	bool outOfMemory;
+	//Regions of every object outside the nursery by size class, allocation fills the first one of a class
+	Region* regions[REGION_CLASSES];
+	//Regions without a free slot, kept apart so allocation doesn't have to get past them to the ones with room
+	Region* fullRegions[REGION_CLASSES];
+	//Regions that were there when the last collection finished marking and have not been swept yet
+	Region* sweepRegions;
+	//Old bytes when the last marking finished, the sweep takes off the dead ones so it ends up at what survived
+	size_t survivedBytes;
 	//Store all gray objects that still need to mark potential references in a worklist
+	//Minor collections use it for promoted objects that still point into the nursery
 	int grayCount;
 	int grayCapacity;
 	Obj** grayStack;
+#ifdef GC_INCREMENTAL
+	GcPhase gcPhase;
+#endif
+#ifdef GC_CONCURRENT
+	//Background thread doing the marking, vm.grayStack belongs to the VM and marker has it's own
+	Thread* marker;
+	GrayStack markerGray;
+	//Guards the fields below
+	Mutex* gcLock;
+	//Marker sleeps on it while there is nothing to mark
+	CondVar* gcWork;
+	//Gray objects the VM found for the marker to trace
+	GrayStack sharedGray;
+	//Marker went through everything it was given
+	bool markerIdle;
+	bool markerStop;
+#endif
+#ifdef GC_PARALLEL
+	//Threads marking during a collection, worker 0 is the VM's own thread and the others are helpers
+	MarkWorker* markWorkers;
+	int markWorkerCount;
+	//Guards the fields below
+	Mutex* markLock;
+	//Helpers sleep on it until the next collection
+	CondVar* markStart;
+	//VM waits on it for the helpers to finish
+	CondVar* markDone;
+	//Bumped for every collection
+	int markEpoch;
+	//Helpers done with the current collection
+	int markFinished;
+	bool markStop;
+	//Workers that ran out of gray objects, updated atomically, marking is over when all of them did
+	int markIdle;
+#endif
+#ifdef GC_GENERATIONAL
+	//Young generation, objects get bump allocated between nursery and nurseryTop
+	char* nursery;
+	char* nurseryTop;
+	//Safepoints run a minor collection once nurseryTop passes this
+	char* nurseryLimit;
+	//Mark bits of the nursery, 1 per 8 bytes
+	uint32_t* nurseryMarks;
+	//Old objects that got a reference to a young object stored into them since the last minor collection
+	int rememberedCount;
+	int rememberedCapacity;
+	Obj** remembered;
+#endif
+#ifdef GC_PRETENURE
+	//Every allocation site so far, index 0 is unused so a cache can tell it got no site yet
+	AllocSite* sites;
+	int siteCount;
+	int siteCapacity;
+	//Set right before an allocation to the site it's for, the allocation clears it again
+	int allocSite;
+	//Objects from a site in the nursery
+	int youngSiteCount;
+	int youngSiteCapacity;
+	YoungSite* youngSites;
+	//Regions pretenured objects go in, kept apart from promoted objects and never compacted
+	Region* tenuredRegions[REGION_CLASSES];
+	Region* tenuredFullRegions[REGION_CLASSES];
+#endif
+#ifdef GC_COMPACT
+	//Last sweep left enough free slots behind, the next safepoint compacts
+	bool compactPending;
+#endif
+#ifdef GC_COMPRESSED_REFS
+	//Reserved block every object, region and the nursery are in, a Ref is an offset from here
+	char* heap;
+	//Blocks are carved off at heapTop, memory is committed up to heapCommitted
+	char* heapTop;
+	char* heapCommitted;
+	//Freed blocks by size in granules, linked through their first word
+	void* heapFree[HEAP_FREE_LISTS];
+	//Freed blocks bigger than HEAP_FREE_MAX, first fit
+	FreeBlock* heapLargeFree;
+	//Bytes on all the free lists together
+	size_t heapFreeBytes;
+#endif
 
 } VM;
 
@@ -60,7 +242,7 @@ typedef enum {
 
 extern VM vm;
 
-void init_vm(void);
+void init_vm(const GcOptions* options);
 void free_vm(void);
 InterpretResult interpret(const char* source);
 void push_stack(Value value);